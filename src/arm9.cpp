@@ -24,6 +24,7 @@
 #include "core.h"
 #include "interrupts.h"
 #include "memory.h"
+#include "state.h"
 
 namespace Arm9 {
     uint32_t *registers[32];
@@ -34,6 +35,9 @@ namespace Arm9 {
     uint32_t registersIrq[2];
     uint32_t registersUnd[2];
 
+    uint64_t cycles;
+    uint64_t deadline;
+
     uint32_t pipeline[2];
     uint32_t cpsr, *spsr;
     uint32_t spsrFiq;
@@ -41,9 +45,17 @@ namespace Arm9 {
     uint32_t spsrAbt;
     uint32_t spsrIrq;
     uint32_t spsrUnd;
+
+    void runArm();
+    void runThumb();
 }
 
 void Arm9::reset() {
+    // Reset the cycle counts
+    cycles = 0;
+    deadline = 0;
+    idleCycles = 0;
+
     // Reset the register arrays
     memset(registersUsr, 0, sizeof(registersUsr));
     memset(registersFiq, 0, sizeof(registersFiq));
@@ -62,35 +74,90 @@ void Arm9::reset() {
     spsrUnd = 0;
 
     // Prepare for code execution
+    clearBlocks();
     for (int i = 0; i < 32; i++)
         registers[i] = &registersUsr[i & 0xF];
     setCpsr(0xD3); // Supervisor, interrupts off
     flushPipeline();
 }
 
-int Arm9::runOpcode() {
-    // Push the next opcode through the pipeline
-    uint32_t opcode = pipeline[0];
-    pipeline[0] = pipeline[1];
+void Arm9::syncState(State &state) {
+    // Save or load the registers, pipeline, and cycle count
+    state.sync(registersUsr);
+    state.sync(registersFiq);
+    state.sync(registersSvc);
+    state.sync(registersAbt);
+    state.sync(registersIrq);
+    state.sync(registersUnd);
+    state.sync(cpsr);
+    state.sync(spsrFiq);
+    state.sync(spsrSvc);
+    state.sync(spsrAbt);
+    state.sync(spsrIrq);
+    state.sync(spsrUnd);
+    state.sync(pipeline);
+    state.sync(cycles);
+    if (!state.loading) return;
 
-    // Execute an instruction
-    if (cpsr & 0x20) { // THUMB mode
-        // Fill the pipeline, incrementing the program counter
-        pipeline[1] = Memory::read<uint16_t>(*registers[15] += 2);
+    // Point to the banked registers of the loaded mode, and drop code decoded from the old RAM
+    for (int i = 0; i < 32; i++)
+        registers[i] = &registersUsr[i & 0xF];
+    swapRegisters(cpsr);
+    clearBlocks();
+}
 
-        // Execute a THUMB instruction
-        return (*thumbInstrs[(opcode >> 6) & 0x3FF])(opcode);
+void Arm9::runUntil(uint64_t target) {
+    // Run the CPU in its current mode until the deadline, which can move earlier if a task is scheduled
+    Core::globalCycles = cycles;
+    deadline = target;
+    while (Core::globalCycles < deadline) {
+        if (blockCache)
+            runCached();
+        else if (cpsr & 0x20)
+            runThumb();
+        else
+            runArm();
     }
-    else { // ARM mode
-        // Fill the pipeline, incrementing the program counter
+    cycles = Core::globalCycles;
+}
+
+void Arm9::runArm() {
+    // Run ARM opcodes until the deadline or a switch to THUMB mode
+    while (Core::globalCycles < deadline) {
+        // Push the next opcode through the pipeline, incrementing the program counter
+        uint32_t opcode = pipeline[0];
+        pipeline[0] = pipeline[1];
         pipeline[1] = Memory::read<uint32_t>(*registers[15] += 4);
 
         // Execute an ARM instruction based on its condition
         switch (condition[((opcode >> 24) & 0xF0) | (cpsr >> 28)]) {
-            case 0: return 1; // False
-            case 2: return ((opcode & 0xE000000) == 0xA000000) ? blx(opcode) : 1; // BLX
-            default: return (*armInstrs[((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0xF)])(opcode);
+        case 0: // False
+            Core::globalCycles += 1;
+            continue;
+        case 2: // BLX
+            Core::globalCycles += ((opcode & 0xE000000) == 0xA000000) ? blx(opcode) : 1;
+            break;
+        default:
+            Core::globalCycles += (*armInstrs[((opcode >> 16) & 0xFF0) | ((opcode >> 4) & 0xF)])(opcode);
+            break;
         }
+
+        // Leave the loop if the instruction switched to THUMB mode
+        if (cpsr & 0x20) return;
+    }
+}
+
+void Arm9::runThumb() {
+    // Run THUMB opcodes until the deadline or a switch to ARM mode
+    while (Core::globalCycles < deadline) {
+        // Push the next opcode through the pipeline, incrementing the program counter
+        uint16_t opcode = pipeline[0];
+        pipeline[0] = pipeline[1];
+        pipeline[1] = Memory::read<uint16_t>(*registers[15] += 2);
+
+        // Execute a THUMB instruction and leave the loop if it switched to ARM mode
+        Core::globalCycles += (*thumbInstrs[(opcode >> 6) & 0x3FF])(opcode);
+        if (~cpsr & 0x20) return;
     }
 }
 
@@ -106,13 +173,21 @@ int Arm9::exception(uint8_t vector) {
 
 void Arm9::flushPipeline() {
     // Adjust the program counter and refill the pipeline after a jump
-    if (cpsr & 0x20) { // THUMB mode
+    // The pipeline is skipped when using the block cache, which decodes opcodes ahead of time
+    if (cpsr & 0x20) // THUMB mode
         *registers[15] = (*registers[15] & ~0x1) + 2;
+    else // ARM mode
+        *registers[15] = (*registers[15] & ~0x3) + 4;
+    if (!blockCache) fillPipeline();
+}
+
+void Arm9::fillPipeline() {
+    // Load the next two opcodes into the pipeline, leaving the program counter where it is
+    if (cpsr & 0x20) { // THUMB mode
         pipeline[0] = Memory::read<uint16_t>(*registers[15] - 2);
         pipeline[1] = Memory::read<uint16_t>(*registers[15]);
     }
     else { // ARM mode
-        *registers[15] = (*registers[15] & ~0x3) + 4;
         pipeline[0] = Memory::read<uint32_t>(*registers[15] - 4);
         pipeline[1] = Memory::read<uint32_t>(*registers[15]);
     }
@@ -204,7 +279,7 @@ void Arm9::setCpsr(uint32_t value, bool save) {
     cpsr = value;
 
     // Check if an interrupt should happen with the new CPSR
-    Core::schedule(Interrupts::checkIrqs, 1);
+    Core::scheduleUnique(Interrupts::checkEvent, Interrupts::checkIrqs, 1);
 }
 
 int Arm9::unkArm(uint32_t opcode) {
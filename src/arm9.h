@@ -20,11 +20,39 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
+
+struct State;
+
+struct BlockOp {
+    union {
+        int (*arm)(uint32_t);
+        int (*thumb)(uint16_t);
+    };
+    uint32_t opcode;
+    uint8_t cond;
+};
+
+struct Block {
+    uint32_t address;
+    bool thumb;
+    uint8_t idleOps; // Opcodes up to a branch back to the start that could loop idly, or 0
+    std::vector<BlockOp> ops;
+    void (*code)();
+};
 
 namespace Arm9 {
     extern uint32_t *registers[32];
     extern uint32_t registersUsr[16];
     extern uint32_t cpsr, *spsr;
+    extern uint64_t cycles;
+    extern uint64_t deadline;
+    extern bool blockCache;
+    extern bool blockStale;
+    extern bool jit;
+    extern bool idleSkip;
+    extern uint64_t idleCycles;
+    extern uint8_t codePages[0x400];
 
     extern int (*armInstrs[0x1000])(uint32_t);
     extern int (*thumbInstrs[0x400])(uint16_t);
@@ -32,9 +60,19 @@ namespace Arm9 {
     extern const uint8_t bitCount[0x100];
 
     void reset();
-    int runOpcode();
+    void syncState(State &state);
+    void runUntil(uint64_t target);
+    void runCached();
+    void clearBlocks();
+    void setBlockCache(bool enable);
+    void setIdleSkip(bool enable);
+    void invalidateBlocks(uint32_t address);
+    void setJit(bool enable);
+    bool compileBlock(Block *block);
+    void resetJit();
     int exception(uint8_t vector);
     void flushPipeline();
+    void fillPipeline();
     void swapRegisters(uint32_t value);
     void setCpsr(uint32_t value, bool save = false);
 
@@ -0,0 +1,325 @@
+/*
+    Copyright 2024 Hydr8gon
+
+    This file is part of GamePawd.
+
+    GamePawd is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GamePawd is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "arm9.h"
+#include "core.h"
+#include "memory.h"
+
+#define MAX_BLOCK 64
+#define LOOKUP_SIZE 0x4000
+
+namespace Arm9 {
+    bool blockCache = false;
+    bool idleSkip = true;
+    uint64_t idleCycles;
+    uint8_t codePages[0x400];
+
+    std::unordered_map<uint32_t, Block*> blocks;
+    std::vector<Block*> pageBlocks[0x400];
+    std::vector<Block*> staleBlocks;
+    Block *blockLookup[LOOKUP_SIZE];
+    bool blockStale;
+
+    bool endsBlock(const BlockOp &op, bool thumb);
+    bool idleArm(uint32_t opcode);
+    bool idleThumb(uint16_t opcode);
+    uint8_t findIdleLoop(const Block *block);
+    Block *getBlock(uint32_t address, bool thumb);
+    void runArmBlock(Block *block);
+    void runThumbBlock(Block *block);
+}
+
+void Arm9::clearBlocks() {
+    // Free every decoded block and stop watching code pages
+    for (auto it = blocks.begin(); it != blocks.end(); it++)
+        delete it->second;
+    for (uint32_t i = 0; i < staleBlocks.size(); i++)
+        delete staleBlocks[i];
+    for (int i = 0; i < 0x400; i++) {
+        if (codePages[i]) Memory::protectPage(i << 12, WATCH_CODE, false);
+        pageBlocks[i].clear();
+    }
+    blocks.clear();
+    staleBlocks.clear();
+    memset(blockLookup, 0, sizeof(blockLookup));
+    memset(codePages, 0, sizeof(codePages));
+    blockStale = false;
+    resetJit();
+}
+
+void Arm9::setBlockCache(bool enable) {
+    // Switch between the block cache and the pipelined interpreter, which is safe between opcodes
+    // Both keep the program counter one opcode past the next, so only the interpreter's pipeline needs loading
+    // Registers aren't set up before the first reset, which fills the pipeline itself
+    clearBlocks();
+    blockCache = enable;
+    if (!enable && registers[15]) fillPipeline();
+}
+
+void Arm9::setIdleSkip(bool enable) {
+    // Enable or disable skipping ahead when the block cache finds an idle loop
+    idleSkip = enable;
+}
+
+void Arm9::invalidateBlocks(uint32_t address) {
+    // Drop all blocks decoded from the physical RAM page that was written
+    uint32_t page = (address & 0x3FFFFF) >> 12;
+    std::vector<Block*> &list = pageBlocks[page];
+    for (uint32_t i = 0; i < list.size(); i++) {
+        Block *block = list[i];
+        uint32_t key = block->address | block->thumb;
+        blocks.erase(key);
+        if (blockLookup[(key >> 1) & (LOOKUP_SIZE - 1)] == block)
+            blockLookup[(key >> 1) & (LOOKUP_SIZE - 1)] = nullptr;
+
+        // Defer freeing in case the block is the one running
+        staleBlocks.push_back(block);
+    }
+
+    // Stop watching the page and tell a running block to stop
+    list.clear();
+    codePages[page] = 0;
+    Memory::protectPage(address, WATCH_CODE, false);
+    blockStale = true;
+}
+
+bool Arm9::endsBlock(const BlockOp &op, bool thumb) {
+    // Stop decoding after unconditional jumps, since what follows is likely not code
+    if (thumb)
+        return op.thumb == bT || op.thumb == bxRegT || op.thumb == blxRegT ||
+            op.thumb == popPcT || op.thumb == blOffT || op.thumb == blxOffT || op.thumb == swiT;
+    return op.cond >= 0xE0 && (op.arm == b || op.arm == bl || op.arm == bx ||
+        op.arm == blxReg || op.arm == blx || op.arm == swi);
+}
+
+bool Arm9::idleArm(uint32_t opcode) {
+    // Allow loads without writeback, and data processing that doesn't touch the status register or write the program counter
+    // Multiplies and swaps are left out along with everything else, since idle loops don't need them
+    if (((opcode >> 12) & 0xF) == 15)
+        return false;
+    if ((opcode & 0x0E000090) == 0x00000090) // Halfword and signed loads
+        return (opcode & 0x60) && (opcode & 0x1100000) == 0x1100000 && !(opcode & 0x200000);
+    if ((opcode & 0xC000000) == 0x0000000) // Data processing
+        return (opcode & 0x1900000) != 0x1000000;
+    if ((opcode & 0xC000000) == 0x4000000) // Word and byte loads
+        return (opcode & 0x1100000) == 0x1100000 && !(opcode & 0x200000) && (opcode & 0x2000010) != 0x2000010;
+    return false;
+}
+
+bool Arm9::idleThumb(uint16_t opcode) {
+    // Allow loads and register operations that don't write the program counter, like for ARM
+    if (opcode < 0x4000) // Shifts, additions, and immediate operations
+        return true;
+    if ((opcode & 0xFC00) == 0x4000) // ALU operations
+        return true;
+    if ((opcode & 0xFC00) == 0x4400) // High register operations, excluding BX and program counter writes
+        return (opcode & 0x300) == 0x100 || ((opcode & 0x300) != 0x300 && (opcode & 0x87) != 0x87);
+    if ((opcode & 0xF800) == 0x4800) // PC-relative loads
+        return true;
+    if ((opcode & 0xF000) == 0x5000) // Register offset loads, excluding STR, STRB, and STRH
+        return (opcode & 0xE00) != 0x000 && (opcode & 0xE00) != 0x400 && (opcode & 0xE00) != 0x200;
+    if ((opcode & 0xE000) == 0x6000 || (opcode & 0xE000) == 0x8000) // Immediate offset and SP-relative loads
+        return opcode & 0x800;
+    if ((opcode & 0xF000) == 0xA000) // PC and SP additions into a register
+        return true;
+    return false;
+}
+
+uint8_t Arm9::findIdleLoop(const Block *block) {
+    // Look for a branch back to the start of a block, with only opcodes before it that can't have side effects
+    // Branches elsewhere are fine too, since taking them just leaves the loop
+    uint32_t pc = block->address;
+    for (uint32_t i = 0; i < block->ops.size(); i++) {
+        uint32_t opcode = block->ops[i].opcode;
+        uint32_t target;
+        if (block->thumb) {
+            if ((opcode & 0xF000) == 0xD000 && (opcode & 0xE00) != 0xE00) // Conditional B
+                target = pc + 4 + int8_t(opcode) * 2;
+            else if ((opcode & 0xF800) == 0xE000) // B
+                target = pc + 4 + (int32_t(opcode << 21) >> 20);
+            else if (idleThumb(opcode))
+                target = 0;
+            else
+                return 0;
+            pc += 2;
+        }
+        else {
+            if (block->ops[i].cond == 0xF0)
+                return 0;
+            else if ((opcode & 0xF000000) == 0xA000000) // B
+                target = pc + 8 + (int32_t(opcode << 8) >> 6);
+            else if (idleArm(opcode))
+                target = 0;
+            else
+                return 0;
+            pc += 4;
+        }
+        if (target == block->address)
+            return i + 1;
+    }
+    return 0;
+}
+
+Block *Arm9::getBlock(uint32_t address, bool thumb) {
+    // Look up a decoded block, checking the direct-mapped table before the full map
+    uint32_t key = address | thumb;
+    Block *&entry = blockLookup[(key >> 1) & (LOOKUP_SIZE - 1)];
+    if (entry && entry->address == address && entry->thumb == thumb)
+        return entry;
+    auto it = blocks.find(key);
+    if (it != blocks.end())
+        return (entry = it->second);
+
+    // Decode a new block up to a jump, a size limit, or the end of the page
+    // Code outside of RAM is decoded one opcode at a time and never cached
+    Block *block = new Block();
+    block->address = address;
+    block->thumb = thumb;
+    bool ram = (address < 0x40000000);
+    uint32_t end = ram ? ((address | 0xFFF) + 1) : (address + (thumb ? 2 : 4));
+    for (uint32_t pc = address; pc < end && block->ops.size() < MAX_BLOCK; pc += (thumb ? 2 : 4)) {
+        BlockOp op;
+        if (thumb) {
+            op.opcode = Memory::read<uint16_t>(pc);
+            op.thumb = thumbInstrs[(op.opcode >> 6) & 0x3FF];
+            op.cond = 0xE0;
+        }
+        else {
+            // Resolve the BLX special case ahead of time, leaving null for a no-op
+            op.opcode = Memory::read<uint32_t>(pc);
+            op.cond = (op.opcode >> 24) & 0xF0;
+            if (op.cond == 0xF0)
+                op.arm = ((op.opcode & 0xE000000) == 0xA000000) ? blx : nullptr;
+            else
+                op.arm = armInstrs[((op.opcode >> 16) & 0xFF0) | ((op.opcode >> 4) & 0xF)];
+        }
+        block->ops.push_back(op);
+        if (endsBlock(op, thumb)) break;
+    }
+
+    // Hand back uncached blocks through the stale list so they get freed later
+    if (!ram) {
+        staleBlocks.push_back(block);
+        return block;
+    }
+
+    // Cache the block and watch its page for writes, checking if it could be an idle loop
+    block->idleOps = findIdleLoop(block);
+    uint32_t page = (address & 0x3FFFFF) >> 12;
+    pageBlocks[page].push_back(block);
+    if (!codePages[page]) Memory::protectPage(address, WATCH_CODE, true);
+    codePages[page] = 1;
+    blocks[key] = block;
+    entry = block;
+
+    // Compile the block if the JIT is on, starting over with empty code memory if it's full
+    if (jit && !compileBlock(block)) {
+        clearBlocks();
+        return getBlock(address, thumb);
+    }
+    return block;
+}
+
+void Arm9::runCached() {
+    // Free blocks that were invalidated now that none of them are running
+    if (!staleBlocks.empty()) {
+        for (uint32_t i = 0; i < staleBlocks.size(); i++)
+            delete staleBlocks[i];
+        staleBlocks.clear();
+    }
+
+    // Get the block at the address of the next opcode, which trails the program counter
+    blockStale = false;
+    bool thumb = (cpsr & 0x20);
+    Block *block = getBlock(*registers[15] - (thumb ? 2 : 4), thumb);
+
+    // Save what an iteration could change if the block might be an idle loop
+    uint32_t saved[16];
+    bool idle = (idleSkip && block->idleOps);
+    if (idle) {
+        for (int i = 0; i < 15; i++)
+            saved[i] = *registers[i];
+        saved[15] = cpsr;
+        Memory::volatileRead = false;
+    }
+
+    // Run the block's compiled code if it has any, or interpret its decoded opcodes
+    if (block->code)
+        (*block->code)();
+    else if (thumb)
+        runThumbBlock(block);
+    else
+        runArmBlock(block);
+
+    // Skip to the deadline if the loop came back around with nothing changed and no volatile I/O read
+    // What it reads can only change with a scheduled task, so every iteration until then would be the same
+    if (!idle || Memory::volatileRead || cpsr != saved[15] || Core::globalCycles >= deadline ||
+            *registers[15] - (thumb ? 2 : 4) != block->address)
+        return;
+    for (int i = 0; i < 15; i++)
+        if (*registers[i] != saved[i]) return;
+    idleCycles += deadline - Core::globalCycles;
+    Core::globalCycles = deadline;
+}
+
+void Arm9::runArmBlock(Block *block) {
+    // Run ARM opcodes from a block until it ends, jumps, or something needs attention
+    uint32_t pc = block->address + 8;
+    for (uint32_t i = 0; i < block->ops.size(); i++, pc += 4) {
+        // Set the program counter as the pipeline would have it
+        BlockOp &op = block->ops[i];
+        *registers[15] = pc;
+
+        // Execute an ARM instruction based on its condition
+        switch (condition[op.cond | (cpsr >> 28)]) {
+        case 0: // False
+            Core::globalCycles += 1;
+            break;
+        case 2: // BLX
+            Core::globalCycles += op.arm ? (*op.arm)(op.opcode) : 1;
+            break;
+        default:
+            Core::globalCycles += (*op.arm)(op.opcode);
+            break;
+        }
+
+        // Leave on a jump, a switch to THUMB, a code write, or the deadline
+        if (*registers[15] != pc || (cpsr & 0x20) || blockStale || Core::globalCycles >= deadline)
+            return;
+    }
+}
+
+void Arm9::runThumbBlock(Block *block) {
+    // Run THUMB opcodes from a block until it ends, jumps, or something needs attention
+    uint32_t pc = block->address + 4;
+    for (uint32_t i = 0; i < block->ops.size(); i++, pc += 2) {
+        // Set the program counter as the pipeline would have it and execute a THUMB instruction
+        BlockOp &op = block->ops[i];
+        *registers[15] = pc;
+        Core::globalCycles += (*op.thumb)(op.opcode);
+
+        // Leave on a jump, a switch to ARM, a code write, or the deadline
+        if (*registers[15] != pc || (~cpsr & 0x20) || blockStale || Core::globalCycles >= deadline)
+            return;
+    }
+}
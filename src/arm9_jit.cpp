@@ -0,0 +1,1014 @@
+/*
+    Copyright 2024 Hydr8gon
+
+    This file is part of GamePawd.
+
+    GamePawd is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GamePawd is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+
+#include "arm9.h"
+
+namespace Arm9 {
+    bool jit = false;
+}
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "memory.h"
+
+#define JIT_SIZE 0x2000000
+#define MAX_PATCHES (JIT_SIZE / 64)
+#define MAX_OP_CODE 0x200
+#define CACHE_SIZE 5
+
+// Host registers, condition codes, and ALU/shift extensions used by the code emitter
+enum HostReg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum HostCond { CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A, CC_S, CC_NS };
+enum HostAlu { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+enum HostShift { SHIFT_ROR = 1, SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7 };
+
+// ARM data processing opcodes
+enum ArmAlu { AND, EOR, SUB, RSB, ADD, ADC, SBC, RSC, TST, TEQ, CMP, CMN, ORR, MOV, BIC, MVN };
+
+// A fastmem access, the code to patch over if it faults, and where its slow path is
+struct FastPatch {
+    uint8_t *access;
+    uint8_t *start;
+    uint8_t *slow;
+};
+
+namespace Arm9 {
+    // Guest registers are kept in callee-saved host registers so they survive memory calls
+    const int cacheHosts[CACHE_SIZE] = { RBP, R12, R13, R14, R15 };
+
+    uint8_t *jitBase;
+    uint8_t *jitPtr;
+    intptr_t jitWritable;
+    uint8_t *epilogue;
+    uintptr_t globals;
+    bool fastmem;
+
+    // Patch sites are added in code order, so they stay sorted for the fault handler to search
+    // Only sites of fully compiled blocks are published, and the array never moves or allocates
+    FastPatch fastPatches[MAX_PATCHES];
+    uint32_t patchCount;
+    std::atomic<uint32_t> patchesReady;
+    struct sigaction oldAction;
+
+    int8_t cacheGuest[CACHE_SIZE];
+    bool cacheDirty[CACHE_SIZE];
+    uint32_t cacheAge[CACHE_SIZE];
+    uint32_t cacheClock;
+    uint8_t cacheLocked;
+
+    bool initJit();
+    void handleFault(int, siginfo_t *info, void *context);
+    uint8_t *writable(uint8_t *code);
+    int32_t global(const void *pointer);
+
+    void emit8(uint8_t value);
+    void emit32(uint32_t value);
+    void emit64(uint64_t value);
+    void emitRex(bool wide, int reg, int rm, int index = 0);
+    void emitRegOp(bool wide, uint16_t op, int reg, int rm);
+    void emitMemOp(bool wide, uint16_t op, int reg, int base, int32_t disp);
+    void emitIdxOp(bool wide, uint16_t op, int reg, int base, int index, int scale = 0);
+    void emitMovImm(int reg, uint32_t value);
+    void emitMovImm64(int reg, uint64_t value);
+    void emitCall(const void *func);
+    uint8_t *emitJcc(int cond);
+    uint8_t *emitJmp();
+    void emitJccTo(int cond, uint8_t *target);
+    void emitJmpTo(uint8_t *target);
+    void setLabel(uint8_t *rel);
+
+    void beginOp();
+    int allocSlot(int guest);
+    int getReg(int guest);
+    int setReg(int guest);
+    void loadOperand(int reg, int guest, uint32_t pc);
+    void writeBack(bool forget);
+
+    void emitCondition(uint8_t cond);
+    void emitFlags(uint32_t mask, int carry);
+    void emitAlu(int code, bool flags);
+    void emitExit(uint32_t pc);
+    void endNative(uint32_t pc, int cycles, bool store);
+    void emitMapLookup(uint8_t **map, int size);
+    uint8_t *emitFastLookup(uint8_t *base, int size);
+    void emitLoad(int size, int rd, uint32_t pc);
+    void emitStore(int size, int rd, uint32_t pc);
+    void emitBranch(uint8_t cond, bool link, uint32_t pc, uint32_t target);
+    void emitHandler(const BlockOp &op, uint32_t pc, bool thumb);
+
+    bool compileArm(const BlockOp &op, uint32_t pc);
+    bool compileArmAlu(uint32_t opcode, uint32_t pc);
+    bool compileArmTransfer(uint32_t opcode, uint32_t pc);
+    bool compileThumb(const BlockOp &op, uint32_t pc);
+}
+
+bool Arm9::initJit() {
+#ifdef __linux__
+    // Map memory for generated code twice, so no page is ever both writable and executable
+    // Code is emitted and patched through the writable view, and runs from the executable one
+    int fd = memfd_create("gamepawd-jit", 0);
+    if (fd < 0 || ftruncate(fd, JIT_SIZE) < 0) {
+        if (fd >= 0) close(fd);
+        printf("Failed to allocate memory for the JIT\n");
+        return false;
+    }
+    void *memory = mmap(nullptr, JIT_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    void *view = mmap(nullptr, JIT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED || view == MAP_FAILED) {
+        if (memory != MAP_FAILED) munmap(memory, JIT_SIZE);
+        if (view != MAP_FAILED) munmap(view, JIT_SIZE);
+        printf("Failed to allocate memory for the JIT\n");
+        return false;
+    }
+    jitWritable = (intptr_t)view - (intptr_t)memory;
+#else
+    // Allocate memory for generated code, which is made writable only while a block is compiled
+    void *memory = mmap(nullptr, JIT_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        printf("Failed to allocate memory for the JIT\n");
+        return false;
+    }
+#endif
+
+    // Generated code addresses globals relative to the cycle count, so they must all be within range
+    globals = (uintptr_t)&Core::globalCycles;
+    const void *pointers[] = { &deadline, &cpsr, registers, &registersUsr[15], &blockStale, condition,
+        Memory::readMap, Memory::readMap + 0x100000, Memory::writeMap, Memory::writeMap + 0x100000 };
+    for (uint32_t i = 0; i < sizeof(pointers) / sizeof(pointers[0]); i++) {
+        intptr_t disp = (intptr_t)pointers[i] - (intptr_t)globals;
+        if (disp != (int32_t)disp) {
+            printf("JIT globals are out of range\n");
+            munmap(memory, JIT_SIZE);
+            if (jitWritable) munmap((uint8_t*)memory + jitWritable, JIT_SIZE);
+            return false;
+        }
+    }
+
+#ifdef __linux__
+    // Catch faults in fastmem so accesses that hit I/O or protected pages can be patched
+    if (Memory::initFastmem()) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = handleFault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        fastmem = (sigaction(SIGSEGV, &action, &oldAction) == 0);
+    }
+#endif
+
+    jitBase = jitPtr = (uint8_t*)memory;
+    return true;
+}
+
+void Arm9::handleFault(int, siginfo_t *info, void *context) {
+#ifdef __linux__
+    // Find the faulting fastmem access with a binary search, which is safe to do in a signal handler
+    ucontext_t *uc = (ucontext_t*)context;
+    uint8_t *rip = (uint8_t*)uc->uc_mcontext.gregs[REG_RIP];
+    uint32_t low = 0, high = patchesReady.load(std::memory_order_acquire);
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (fastPatches[mid].access < rip)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if (low < patchesReady.load(std::memory_order_relaxed) && fastPatches[low].access == rip) {
+        // Send a store to a watched RAM page through the slow path just this once, which handles and lifts the watch
+        // Patching it would keep the store slow after the page is mapped again, and the watches are rearmed often
+        uint8_t *address = (uint8_t*)info->si_addr;
+        if (address >= Memory::fastWrite && address < Memory::fastWrite + 0x400000) {
+            uc->uc_mcontext.gregs[REG_RIP] = (greg_t)fastPatches[low].slow;
+            return;
+        }
+
+        // Redirect other accesses, which hit I/O or mirrors, to the slow path for good, and resume there
+        uint8_t *start = fastPatches[low].start;
+        int32_t rel = fastPatches[low].slow - (start + 5);
+        uint8_t *code = writable(start);
+        code[0] = 0xE9;
+        memcpy(&code[1], &rel, sizeof(rel));
+        uc->uc_mcontext.gregs[REG_RIP] = (greg_t)start;
+        return;
+    }
+
+    // Let the previous handler take any other fault when the access is retried
+    sigaction(SIGSEGV, &oldAction, nullptr);
+#endif
+}
+
+void Arm9::setJit(bool enable) {
+    // Enable or disable the JIT, which compiles blocks for the block cache to run
+    if (enable && !jitBase && !initJit())
+        enable = false;
+    jit = enable;
+    setBlockCache(blockCache || enable);
+}
+
+void Arm9::resetJit() {
+    // Drop all generated code; the blocks that pointed to it must be cleared as well
+    jitPtr = jitBase;
+    patchesReady.store(0, std::memory_order_release);
+    patchCount = 0;
+}
+
+uint8_t *Arm9::writable(uint8_t *code) {
+    // Get where generated code can be written, which is a separate view of it on Linux
+    return code + jitWritable;
+}
+
+int32_t Arm9::global(const void *pointer) {
+    // Get the displacement of a global from the base register
+    return (intptr_t)pointer - (intptr_t)globals;
+}
+
+void Arm9::emit8(uint8_t value) {
+    // Write a byte of generated code
+    *writable(jitPtr++) = value;
+}
+
+void Arm9::emit32(uint32_t value) {
+    // Write a 32-bit value of generated code
+    memcpy(writable(jitPtr), &value, sizeof(value));
+    jitPtr += sizeof(value);
+}
+
+void Arm9::emit64(uint64_t value) {
+    // Write a 64-bit value of generated code
+    memcpy(writable(jitPtr), &value, sizeof(value));
+    jitPtr += sizeof(value);
+}
+
+void Arm9::emitRex(bool wide, int reg, int rm, int index) {
+    // Write a REX prefix if the operation is 64-bit or uses extended registers
+    uint8_t rex = 0x40 | (wide << 3) | ((reg & 0x8) >> 1) | ((index & 0x8) >> 2) | ((rm & 0x8) >> 3);
+    if (rex != 0x40) emit8(rex);
+}
+
+void Arm9::emitRegOp(bool wide, uint16_t op, int reg, int rm) {
+    // Write an operation with a register operand
+    emitRex(wide, reg, rm);
+    if (op > 0xFF) emit8(op >> 8);
+    emit8(op);
+    emit8(0xC0 | ((reg & 0x7) << 3) | (rm & 0x7));
+}
+
+void Arm9::emitMemOp(bool wide, uint16_t op, int reg, int base, int32_t disp) {
+    // Write an operation with a [base + disp] memory operand, using the shortest displacement
+    emitRex(wide, reg, base);
+    if (op > 0xFF) emit8(op >> 8);
+    emit8(op);
+    uint8_t mod = (disp == 0 && (base & 0x7) != RBP) ? 0 : (disp == (int8_t)disp) ? 1 : 2;
+    emit8((mod << 6) | ((reg & 0x7) << 3) | (base & 0x7));
+    if ((base & 0x7) == RSP) emit8(0x24);
+    if (mod == 1) emit8(disp);
+    else if (mod == 2) emit32(disp);
+}
+
+void Arm9::emitIdxOp(bool wide, uint16_t op, int reg, int base, int index, int scale) {
+    // Write an operation with a [base + index << scale] memory operand
+    emitRex(wide, reg, base, index);
+    if (op > 0xFF) emit8(op >> 8);
+    emit8(op);
+    emit8(((reg & 0x7) << 3) | RSP);
+    emit8((scale << 6) | ((index & 0x7) << 3) | (base & 0x7));
+}
+
+void Arm9::emitMovImm(int reg, uint32_t value) {
+    // Write a 32-bit immediate move
+    emitRex(false, 0, reg);
+    emit8(0xB8 | (reg & 0x7));
+    emit32(value);
+}
+
+void Arm9::emitMovImm64(int reg, uint64_t value) {
+    // Write a 64-bit immediate move
+    emitRex(true, 0, reg);
+    emit8(0xB8 | (reg & 0x7));
+    emit64(value);
+}
+
+void Arm9::emitCall(const void *func) {
+    // Write a call to an absolute address through RAX
+    emitMovImm64(RAX, (uintptr_t)func);
+    emitRegOp(false, 0xFF, 2, RAX);
+}
+
+uint8_t *Arm9::emitJcc(int cond) {
+    // Write a conditional jump to be pointed at a label later
+    emit8(0x0F);
+    emit8(0x80 | cond);
+    emit32(0);
+    return jitPtr - 4;
+}
+
+uint8_t *Arm9::emitJmp() {
+    // Write a jump to be pointed at a label later
+    emit8(0xE9);
+    emit32(0);
+    return jitPtr - 4;
+}
+
+void Arm9::emitJccTo(int cond, uint8_t *target) {
+    // Write a conditional jump to code that was already generated
+    emit8(0x0F);
+    emit8(0x80 | cond);
+    emit32(target - (jitPtr + 4));
+}
+
+void Arm9::emitJmpTo(uint8_t *target) {
+    // Write a jump to code that was already generated
+    emit8(0xE9);
+    emit32(target - (jitPtr + 4));
+}
+
+void Arm9::setLabel(uint8_t *rel) {
+    // Point a forward jump at the current position
+    int32_t value = jitPtr - (rel + 4);
+    memcpy(writable(rel), &value, sizeof(value));
+}
+
+void Arm9::beginOp() {
+    // Allow any cached register to be evicted again
+    cacheLocked = 0;
+}
+
+int Arm9::allocSlot(int guest) {
+    // Use the slot already holding the guest register if there is one
+    int slot = -1;
+    for (int i = 0; i < CACHE_SIZE && slot < 0; i++)
+        if (cacheGuest[i] == guest) slot = i;
+
+    // Otherwise use a free slot, or the least recently used one that isn't locked
+    for (int i = 0; i < CACHE_SIZE && slot < 0; i++)
+        if (cacheGuest[i] < 0) slot = i;
+    if (slot < 0) {
+        for (int i = 0; i < CACHE_SIZE; i++) {
+            if (cacheLocked & (1 << i)) continue;
+            if (slot < 0 || cacheAge[i] < cacheAge[slot]) slot = i;
+        }
+    }
+
+    // Write back an evicted register if it was modified
+    if (cacheGuest[slot] != guest && cacheGuest[slot] >= 0 && cacheDirty[slot]) {
+        emitMemOp(true, 0x8B, R11, RBX, global(&registers[cacheGuest[slot]]));
+        emitMemOp(false, 0x89, cacheHosts[slot], R11, 0);
+    }
+
+    // Lock the slot for the rest of the opcode
+    cacheAge[slot] = ++cacheClock;
+    cacheLocked |= (1 << slot);
+    return slot;
+}
+
+int Arm9::getReg(int guest) {
+    // Get a host register holding a guest register, loading it if it isn't cached
+    int slot = allocSlot(guest);
+    if (cacheGuest[slot] != guest) {
+        emitMemOp(true, 0x8B, R11, RBX, global(&registers[guest]));
+        emitMemOp(false, 0x8B, cacheHosts[slot], R11, 0);
+        cacheGuest[slot] = guest;
+        cacheDirty[slot] = false;
+    }
+    return cacheHosts[slot];
+}
+
+int Arm9::setReg(int guest) {
+    // Get a host register to write a guest register to, without loading its old value
+    int slot = allocSlot(guest);
+    cacheGuest[slot] = guest;
+    cacheDirty[slot] = true;
+    return cacheHosts[slot];
+}
+
+void Arm9::loadOperand(int reg, int guest, uint32_t pc) {
+    // Move a guest register into a scratch register, with the program counter as a constant
+    if (guest == 15)
+        emitMovImm(reg, pc);
+    else
+        emitRegOp(false, 0x89, getReg(guest), reg);
+}
+
+void Arm9::writeBack(bool forget) {
+    // Write modified guest registers back through their pointers, which can change between opcodes
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        if (cacheGuest[i] < 0) continue;
+        if (cacheDirty[i]) {
+            emitMemOp(true, 0x8B, R11, RBX, global(&registers[cacheGuest[i]]));
+            emitMemOp(false, 0x89, cacheHosts[i], R11, 0);
+        }
+
+        // Only forget registers on paths that continue, since exits leave the cache state alone
+        if (forget) {
+            cacheGuest[i] = -1;
+            cacheDirty[i] = false;
+        }
+    }
+}
+
+void Arm9::emitCondition(uint8_t cond) {
+    // Look up an ARM condition from the current flags, leaving the zero flag set if it fails
+    emitMemOp(false, 0x8B, RAX, RBX, global(&cpsr));
+    emitRegOp(false, 0xC1, SHIFT_SHR, RAX);
+    emit8(28);
+    emitMemOp(true, 0x8D, RCX, RBX, global(&condition[cond]));
+    emitIdxOp(false, 0x0FB6, RAX, RCX, RAX);
+    emitRegOp(false, 0x85, RAX, RAX);
+}
+
+void Arm9::emitFlags(uint32_t mask, int carry) {
+    // Capture the host flags that map to the ARM flags being set
+    // The carry is only set if a host condition is given for it
+    emitRegOp(false, 0x0F90 | CC_S, 0, RAX);
+    emitRegOp(false, 0x0F90 | CC_E, 0, RDX);
+    if (carry >= 0) emitRegOp(false, 0x0F90 | carry, 0, R8);
+    if (mask & (1 << 28)) emitRegOp(false, 0x0F90 | CC_O, 0, R9);
+
+    // Combine the flags into their CPSR bit positions
+    emitRegOp(false, 0x0FB6, RAX, RAX);
+    emitRegOp(false, 0xC1, SHIFT_SHL, RAX);
+    emit8(31);
+    emitRegOp(false, 0x0FB6, RDX, RDX);
+    emitRegOp(false, 0xC1, SHIFT_SHL, RDX);
+    emit8(30);
+    emitRegOp(false, (ALU_OR << 3) | 1, RDX, RAX);
+    if (carry >= 0) {
+        emitRegOp(false, 0x0FB6, R8, R8);
+        emitRegOp(false, 0xC1, SHIFT_SHL, R8);
+        emit8(29);
+        emitRegOp(false, (ALU_OR << 3) | 1, R8, RAX);
+    }
+    if (mask & (1 << 28)) {
+        emitRegOp(false, 0x0FB6, R9, R9);
+        emitRegOp(false, 0xC1, SHIFT_SHL, R9);
+        emit8(28);
+        emitRegOp(false, (ALU_OR << 3) | 1, R9, RAX);
+    }
+
+    // Merge the flags into the CPSR
+    emitMemOp(false, 0x8B, RDX, RBX, global(&cpsr));
+    emitRegOp(false, 0x81, ALU_AND, RDX);
+    emit32(~mask);
+    emitRegOp(false, (ALU_OR << 3) | 1, RAX, RDX);
+    emitMemOp(false, 0x89, RDX, RBX, global(&cpsr));
+}
+
+void Arm9::emitAlu(int code, bool flags) {
+    // Perform an ARM ALU operation on ECX (Rn) and EAX (op2), leaving the result in ECX
+    switch (code) {
+    case AND: case TST: emitRegOp(false, (ALU_AND << 3) | 1, RAX, RCX); break;
+    case EOR: case TEQ: emitRegOp(false, (ALU_XOR << 3) | 1, RAX, RCX); break;
+    case SUB: case CMP: emitRegOp(false, (ALU_SUB << 3) | 1, RAX, RCX); break;
+    case ADD: case CMN: emitRegOp(false, (ALU_ADD << 3) | 1, RAX, RCX); break;
+    case ORR: emitRegOp(false, (ALU_OR << 3) | 1, RAX, RCX); break;
+
+    case RSB:
+        emitRegOp(false, (ALU_SUB << 3) | 1, RCX, RAX);
+        emitRegOp(false, 0x89, RAX, RCX);
+        break;
+
+    case BIC:
+        emitRegOp(false, 0xF7, 2, RAX);
+        emitRegOp(false, (ALU_AND << 3) | 1, RAX, RCX);
+        break;
+
+    case MOV: case MVN:
+        if (code == MVN) emitRegOp(false, 0xF7, 2, RAX);
+        emitRegOp(false, 0x89, RAX, RCX);
+        if (flags) emitRegOp(false, 0x85, RCX, RCX);
+        break;
+    }
+
+    // Set the ARM flags the same way the interpreter handlers do
+    // Host flags match for everything, except that the carry is inverted for subtraction
+    if (!flags) return;
+    switch (code) {
+    case ADD: case CMN: return emitFlags(0xF0000000, CC_B);
+    case SUB: case CMP: case RSB: return emitFlags(0xF0000000, CC_AE);
+    default: return emitFlags(0xC0000000, -1);
+    }
+}
+
+void Arm9::emitExit(uint32_t pc) {
+    // Leave the block from the middle, storing cached registers and the program counter
+    // The program counter is always the user copy, since it isn't banked
+    writeBack(false);
+    emitMemOp(false, 0xC7, 0, RBX, global(&registersUsr[15]));
+    emit32(pc);
+    emitJmpTo(epilogue);
+}
+
+void Arm9::endNative(uint32_t pc, int cycles, bool store) {
+    // Count the cycles of a natively compiled opcode
+    emitMemOp(true, 0x81, ALU_ADD, RBX, global(&Core::globalCycles));
+    emit32(cycles);
+
+    // Leave the block if a store hit code or the deadline was reached, like the interpreter would
+    uint8_t *stale = nullptr;
+    if (store) {
+        emitMemOp(false, 0x80, ALU_CMP, RBX, global(&blockStale));
+        emit8(0);
+        stale = emitJcc(CC_NE);
+    }
+    emitMemOp(true, 0x8B, RAX, RBX, global(&Core::globalCycles));
+    emitMemOp(true, 0x3B, RAX, RBX, global(&deadline));
+    uint8_t *next = emitJcc(CC_B);
+    if (stale) setLabel(stale);
+    emitExit(pc);
+    setLabel(next);
+}
+
+void Arm9::emitMapLookup(uint8_t **map, int size) {
+    // Look up the page of the address in EDI, leaving its pointer in RAX and the aligned offset in ECX
+    // The zero flag is set if the page isn't mapped
+    emitRegOp(false, 0x89, RDI, RCX);
+    emitRegOp(false, 0xC1, SHIFT_SHR, RCX);
+    emit8(12);
+    emitMemOp(true, 0x8D, RAX, RBX, global(map));
+    emitIdxOp(true, 0x8B, RAX, RAX, RCX, 3);
+    emitRegOp(false, 0x89, RDI, RCX);
+    emitRegOp(false, 0x81, ALU_AND, RCX);
+    emit32(0xFFF & ~(size - 1));
+    emitRegOp(true, 0x85, RAX, RAX);
+}
+
+uint8_t *Arm9::emitFastLookup(uint8_t *base, int size) {
+    // Put a fastmem base in RAX and the aligned address from EDI in ECX, returning where this starts
+    // This is always long enough to be patched over with a jump to the slow path
+    uint8_t *start = jitPtr;
+    emitRegOp(false, 0x89, RDI, RCX);
+    if (size == 4) {
+        emitRegOp(false, 0x81, ALU_AND, RCX);
+        emit32(~3);
+    }
+    emitMovImm64(RAX, (uintptr_t)base);
+    return start;
+}
+
+void Arm9::emitLoad(int size, int rd, uint32_t pc) {
+    // Load from the address in EDI into a guest register, directly through fastmem or a mapped page
+    // Other addresses go through the memory handlers, which also align them
+    int host = setReg(rd);
+    uint8_t *start = nullptr, *slow = nullptr;
+    if (fastmem) {
+        start = emitFastLookup(Memory::fastRead, size);
+    }
+    else {
+        emitMapLookup(Memory::readMap, size);
+        slow = emitJcc(CC_E);
+    }
+    uint8_t *access = jitPtr;
+    emitIdxOp(false, (size == 4) ? 0x8B : 0x0FB6, RAX, RAX, RCX);
+    uint8_t *done = emitJmp();
+
+    // Keep the address across the call for rotation, pushing twice to keep the stack aligned
+    if (slow) setLabel(slow);
+    else fastPatches[patchCount++] = { access, start, jitPtr };
+    emit8(0x50 | RDI);
+    emit8(0x50 | RDI);
+    if (size == 4) {
+        emitCall((const void*)(uint32_t(*)(uint32_t))Memory::read<uint32_t>);
+    }
+    else {
+        emitCall((const void*)(uint8_t(*)(uint32_t))Memory::read<uint8_t>);
+        emitRegOp(false, 0x0FB6, RAX, RAX);
+    }
+    emit8(0x58 | RDI);
+    emit8(0x58 | RDI);
+    setLabel(done);
+
+    // Rotate misaligned word reads
+    if (size == 4) {
+        emitRegOp(false, 0x89, RDI, RCX);
+        emitRegOp(false, 0x81, ALU_AND, RCX);
+        emit32(0x3);
+        emitRegOp(false, 0xC1, SHIFT_SHL, RCX);
+        emit8(3);
+        emitRegOp(false, 0xD3, SHIFT_ROR, RAX);
+    }
+    emitRegOp(false, 0x89, RAX, host);
+    endNative(pc, 1, false);
+}
+
+void Arm9::emitStore(int size, int rd, uint32_t pc) {
+    // Store a guest register to the address in EDI, directly through fastmem or a mapped page
+    // Other addresses go through the memory handlers, which also invalidate blocks in protected pages
+    loadOperand(RSI, rd, pc);
+    uint8_t *start = nullptr, *slow = nullptr;
+    if (fastmem) {
+        start = emitFastLookup(Memory::fastWrite, size);
+    }
+    else {
+        emitMapLookup(Memory::writeMap, size);
+        slow = emitJcc(CC_E);
+    }
+    if (size != 4)
+        emitRegOp(false, 0x89, RSI, RDX);
+    uint8_t *access = jitPtr;
+    if (size == 4)
+        emitIdxOp(false, 0x89, RSI, RAX, RCX);
+    else
+        emitIdxOp(false, 0x88, RDX, RAX, RCX);
+    uint8_t *done = emitJmp();
+
+    // Call the memory handler with the address and value already in place
+    if (slow) setLabel(slow);
+    else fastPatches[patchCount++] = { access, start, jitPtr };
+    if (size == 4)
+        emitCall((const void*)(void(*)(uint32_t, uint32_t))Memory::write<uint32_t>);
+    else
+        emitCall((const void*)(void(*)(uint32_t, uint8_t))Memory::write<uint8_t>);
+    setLabel(done);
+    endNative(pc, 1, true);
+}
+
+void Arm9::emitBranch(uint8_t cond, bool link, uint32_t pc, uint32_t target) {
+    // Check the condition of a branch, skipping it if the condition fails
+    uint8_t *skip = nullptr;
+    if (cond < 0xE0) {
+        emitCondition(cond);
+        skip = emitJcc(CC_E);
+    }
+
+    // Count the cycles and leave the block at the target, which is already adjusted for the pipeline
+    emitMemOp(true, 0x81, ALU_ADD, RBX, global(&Core::globalCycles));
+    emit32(3);
+    writeBack(false);
+    if (link) {
+        emitMemOp(true, 0x8B, R11, RBX, global(&registers[14]));
+        emitMemOp(false, 0xC7, 0, R11, 0);
+        emit32(pc - 4);
+    }
+    emitMemOp(false, 0xC7, 0, RBX, global(&registersUsr[15]));
+    emit32(target);
+    emitJmpTo(epilogue);
+
+    // Continue with the next opcode if the branch wasn't taken
+    if (!skip) return;
+    setLabel(skip);
+    endNative(pc, 1, false);
+}
+
+void Arm9::emitHandler(const BlockOp &op, uint32_t pc, bool thumb) {
+    // Store cached registers and set the program counter for an interpreter handler
+    writeBack(true);
+    emitMemOp(false, 0xC7, 0, RBX, global(&registersUsr[15]));
+    emit32(pc);
+
+    // Treat ARM no-ops as 1 cycle, like a failed condition
+    if (!thumb && !op.arm) {
+        emitMemOp(true, 0x81, ALU_ADD, RBX, global(&Core::globalCycles));
+        emit32(1);
+    }
+    else {
+        // Check the condition of ARM opcodes, counting 1 cycle if it fails
+        uint8_t *check = nullptr;
+        if (!thumb && op.cond < 0xE0) {
+            emitCondition(op.cond);
+            uint8_t *run = emitJcc(CC_NE);
+            emitMemOp(true, 0x81, ALU_ADD, RBX, global(&Core::globalCycles));
+            emit32(1);
+            check = emitJmp();
+            setLabel(run);
+        }
+
+        // Call the handler and count the cycles it returns
+        emitMovImm(RDI, op.opcode);
+        emitCall(thumb ? (const void*)op.thumb : (const void*)op.arm);
+        emitRegOp(true, 0x63, RAX, RAX);
+        emitMemOp(true, 0x01, RAX, RBX, global(&Core::globalCycles));
+
+        // Leave on a jump, a switch to the other mode, or a code write
+        emitMemOp(false, 0x81, ALU_CMP, RBX, global(&registersUsr[15]));
+        emit32(pc);
+        emitJccTo(CC_NE, epilogue);
+        emitMemOp(false, 0xF6, 0, RBX, global(&cpsr));
+        emit8(0x20);
+        emitJccTo(thumb ? CC_E : CC_NE, epilogue);
+        emitMemOp(false, 0x80, ALU_CMP, RBX, global(&blockStale));
+        emit8(0);
+        emitJccTo(CC_NE, epilogue);
+        if (check) setLabel(check);
+    }
+
+    // Leave if the deadline was reached
+    emitMemOp(true, 0x8B, RAX, RBX, global(&Core::globalCycles));
+    emitMemOp(true, 0x3B, RAX, RBX, global(&deadline));
+    emitJccTo(CC_AE, epilogue);
+}
+
+bool Arm9::compileArm(const BlockOp &op, uint32_t pc) {
+    // Compile branches natively, with the target calculated ahead of time
+    uint32_t opcode = op.opcode;
+    if (op.cond != 0xF0 && (op.arm == b || op.arm == bl)) {
+        uint32_t target = ((pc + ((int32_t)(opcode << 8) >> 6)) & ~0x3) + 4;
+        emitBranch(op.cond, op.arm == bl, pc, target);
+        return true;
+    }
+
+    // Leave conditional opcodes to the handlers so every path has the same cached registers
+    if (op.cond != 0xE0) return false;
+    if ((opcode & 0xC000000) == 0x0000000)
+        return compileArmAlu(opcode, pc);
+    if ((opcode & 0xE000000) == 0x4000000)
+        return compileArmTransfer(opcode, pc);
+    return false;
+}
+
+bool Arm9::compileArmAlu(uint32_t opcode, uint32_t pc) {
+    // Decode a data processing opcode, skipping ones that use the carry or can change the mode
+    int code = (opcode >> 21) & 0xF;
+    bool flags = (opcode & (1 << 20));
+    int rn = (opcode >> 16) & 0xF;
+    int rd = (opcode >> 12) & 0xF;
+    bool test = (code >= TST && code <= CMN);
+    if (code >= ADC && code <= RSC) return false;
+    if (test ? !flags : (rd == 15)) return false;
+    if (flags && !test && code != SUB && code != RSB && code != ADD) return false;
+
+    // Only compile immediate shifts, since register shifts read the program counter with +4
+    bool imm = (opcode & (1 << 25));
+    if (!imm && (opcode & 0x10)) return false;
+    int type = (opcode >> 5) & 0x3;
+    int shift = imm ? ((opcode >> 7) & 0x1E) : ((opcode >> 7) & 0x1F);
+    if (!imm && type == 3 && shift == 0) return false;
+
+    // Skip tests that would take the carry from the shifter, except for immediate rotation
+    if ((code == TST || code == TEQ) && !imm && (type != 0 || shift != 0))
+        return false;
+
+    // Load the second operand into EAX, applying the shift like the interpreter helpers
+    beginOp();
+    if (imm) {
+        uint32_t value = opcode & 0xFF;
+        emitMovImm(RAX, shift ? ((value << (32 - shift)) | (value >> shift)) : value);
+    }
+    else if (type == 1 && shift == 0) {
+        emitMovImm(RAX, 0);
+    }
+    else {
+        loadOperand(RAX, opcode & 0xF, pc);
+        static const uint8_t exts[] = { SHIFT_SHL, SHIFT_SHR, SHIFT_SAR, SHIFT_ROR };
+        if (shift || type == 2) {
+            emitRegOp(false, 0xC1, exts[type], RAX);
+            emit8(shift ? shift : 31);
+        }
+    }
+
+    // Load the first operand into ECX and perform the operation
+    if (code != MOV && code != MVN)
+        loadOperand(RCX, rn, pc);
+    emitAlu(code, flags);
+    if ((code == TST || code == TEQ) && imm && shift) {
+        // Immediate rotation sets the carry to the top bit of the value
+        bool carry = (opcode & 0xFF) & (1 << (shift - 1));
+        emitMemOp(false, 0x81, carry ? ALU_OR : ALU_AND, RBX, global(&cpsr));
+        emit32(carry ? (1 << 29) : ~(1 << 29));
+    }
+    if (!test)
+        emitRegOp(false, 0x89, RCX, setReg(rd));
+    endNative(pc, 1, false);
+    return true;
+}
+
+bool Arm9::compileArmTransfer(uint32_t opcode, uint32_t pc) {
+    // Only compile word and byte transfers with an immediate offset and no writeback
+    // Transfers involving the program counter as Rd are left to the handlers
+    if ((~opcode & (1 << 24)) || (opcode & (1 << 21))) return false;
+    int rd = (opcode >> 12) & 0xF;
+    if (rd == 15) return false;
+
+    // Calculate the address in EDI
+    beginOp();
+    int32_t offset = (opcode & (1 << 23)) ? (opcode & 0xFFF) : -(opcode & 0xFFF);
+    loadOperand(RDI, (opcode >> 16) & 0xF, pc);
+    if (offset) {
+        emitRegOp(false, 0x81, ALU_ADD, RDI);
+        emit32(offset);
+    }
+
+    // Perform the transfer
+    int size = (opcode & (1 << 22)) ? 1 : 4;
+    if (opcode & (1 << 20))
+        emitLoad(size, rd, pc);
+    else
+        emitStore(size, rd, pc);
+    return true;
+}
+
+bool Arm9::compileThumb(const BlockOp &op, uint32_t pc) {
+    // Compile branches natively, with the target calculated ahead of time
+    uint16_t opcode = op.opcode;
+    int (*func)(uint16_t) = op.thumb;
+    beginOp();
+    if (func == bT) {
+        emitBranch(0xE0, false, pc, ((pc + ((int16_t)(opcode << 5) >> 4)) & ~0x1) + 2);
+        return true;
+    }
+    if (func == beqT || func == bneT || func == bcsT || func == bccT || func == bmiT || func == bplT ||
+        func == bvsT || func == bvcT || func == bhiT || func == blsT || func == bgeT || func == bltT ||
+        func == bgtT || func == bleT) {
+        emitBranch((opcode >> 4) & 0xF0, false, pc, ((pc + ((int8_t)opcode << 1)) & ~0x1) + 2);
+        return true;
+    }
+
+    // Decode ALU opcodes into an operation, registers, and a second operand
+    int code = -1, rd = opcode & 0x7, rn = rd, rm = -1;
+    uint32_t value = 0;
+    if (func == movImm8T) { code = MOV; rd = (opcode >> 8) & 0x7; value = opcode & 0xFF; }
+    else if (func == addImm8T) { code = ADD; rd = rn = (opcode >> 8) & 0x7; value = opcode & 0xFF; }
+    else if (func == subImm8T) { code = SUB; rd = rn = (opcode >> 8) & 0x7; value = opcode & 0xFF; }
+    else if (func == cmpImm8T) { code = CMP; rd = rn = (opcode >> 8) & 0x7; value = opcode & 0xFF; }
+    else if (func == addImm3T) { code = ADD; rn = (opcode >> 3) & 0x7; value = (opcode >> 6) & 0x7; }
+    else if (func == subImm3T) { code = SUB; rn = (opcode >> 3) & 0x7; value = (opcode >> 6) & 0x7; }
+    else if (func == addRegT) { code = ADD; rn = (opcode >> 3) & 0x7; rm = (opcode >> 6) & 0x7; }
+    else if (func == subRegT) { code = SUB; rn = (opcode >> 3) & 0x7; rm = (opcode >> 6) & 0x7; }
+    else if (func == andDpT) { code = AND; rm = (opcode >> 3) & 0x7; }
+    else if (func == eorDpT) { code = EOR; rm = (opcode >> 3) & 0x7; }
+    else if (func == orrDpT) { code = ORR; rm = (opcode >> 3) & 0x7; }
+    else if (func == bicDpT) { code = BIC; rm = (opcode >> 3) & 0x7; }
+    else if (func == mvnDpT) { code = MVN; rm = (opcode >> 3) & 0x7; }
+    else if (func == tstDpT) { code = TST; rm = (opcode >> 3) & 0x7; }
+    else if (func == cmpDpT) { code = CMP; rm = (opcode >> 3) & 0x7; }
+    else if (func == cmnDpT) { code = CMN; rm = (opcode >> 3) & 0x7; }
+
+    // Compile ALU opcodes, which all set flags
+    if (code >= 0) {
+        if (rm >= 0)
+            loadOperand(RAX, rm, pc);
+        else
+            emitMovImm(RAX, value);
+        if (code != MOV && code != MVN)
+            loadOperand(RCX, rn, pc);
+        emitAlu(code, true);
+        if (code < TST || code > CMN)
+            emitRegOp(false, 0x89, RCX, setReg(rd));
+        endNative(pc, 1, false);
+        return true;
+    }
+
+    // Compile immediate shifts, taking the carry from the host shift
+    // A shift of 0 is a move for LSL, but is left to the handlers for LSR and ASR
+    int shift = (opcode >> 6) & 0x1F;
+    if ((func == lslImmT) || ((func == lsrImmT || func == asrImmT) && shift)) {
+        loadOperand(RAX, (opcode >> 3) & 0x7, pc);
+        if (shift) {
+            emitRegOp(false, 0xC1, (func == lslImmT) ? SHIFT_SHL : (func == lsrImmT) ? SHIFT_SHR : SHIFT_SAR, RAX);
+            emit8(shift);
+            emitRegOp(false, 0x89, RAX, RCX);
+            emitFlags(0xE0000000, CC_B);
+        }
+        else {
+            emitAlu(MOV, true);
+        }
+        emitRegOp(false, 0x89, RCX, setReg(rd));
+        endNative(pc, 1, false);
+        return true;
+    }
+
+    // Compile high register moves, except to the program counter
+    if (func == movHT) {
+        rd = ((opcode >> 4) & 0x8) | (opcode & 0x7);
+        if (rd == 15) return false;
+        loadOperand(RAX, (opcode >> 3) & 0xF, pc);
+        emitRegOp(false, 0x89, RAX, setReg(rd));
+        endNative(pc, 1, false);
+        return true;
+    }
+
+    // Decode word and byte transfers into a size, a base, and an offset
+    int size = 0, base = (opcode >> 3) & 0x7;
+    bool load = false;
+    rm = -1;
+    if (func == ldrImm5T || func == strImm5T) { size = 4; value = (opcode >> 4) & 0x7C; }
+    else if (func == ldrbImm5T || func == strbImm5T) { size = 1; value = (opcode >> 6) & 0x1F; }
+    else if (func == ldrRegT || func == strRegT) { size = 4; rm = (opcode >> 6) & 0x7; }
+    else if (func == ldrbRegT || func == strbRegT) { size = 1; rm = (opcode >> 6) & 0x7; }
+    else if (func == ldrSpT || func == strSpT) { size = 4; rd = (opcode >> 8) & 0x7; base = 13; value = (opcode & 0xFF) << 2; }
+    else if (func == ldrPcT) { size = 4; rd = (opcode >> 8) & 0x7; base = -1; value = (pc & ~0x3) + ((opcode & 0xFF) << 2); }
+    if (!size) return false;
+    load = (func == ldrImm5T || func == ldrbImm5T || func == ldrRegT || func == ldrbRegT || func == ldrSpT || func == ldrPcT);
+
+    // Calculate the address in EDI and perform the transfer
+    if (base < 0) {
+        emitMovImm(RDI, value);
+    }
+    else {
+        loadOperand(RDI, base, pc);
+        if (rm >= 0) {
+            emitRegOp(false, (ALU_ADD << 3) | 1, getReg(rm), RDI);
+        }
+        else if (value) {
+            emitRegOp(false, 0x81, ALU_ADD, RDI);
+            emit32(value);
+        }
+    }
+    if (load)
+        emitLoad(size, rd, pc);
+    else
+        emitStore(size, rd, pc);
+    return true;
+}
+
+bool Arm9::compileBlock(Block *block) {
+    // Make sure the worst case fits, letting the caller clear everything if it doesn't
+    // Each opcode adds at most one fastmem patch site
+    if (jitPtr + (block->ops.size() + 1) * MAX_OP_CODE > jitBase + JIT_SIZE)
+        return false;
+    if (patchCount + block->ops.size() > MAX_PATCHES)
+        return false;
+
+#ifndef __linux__
+    // Make the code memory writable while the block is compiled
+    mprotect(jitBase, JIT_SIZE, PROT_READ | PROT_WRITE);
+#endif
+
+    // Write the shared exit first so everything can jump back to it
+    epilogue = jitPtr;
+    emitRegOp(true, 0x83, ALU_ADD, RSP);
+    emit8(8);
+    static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+    for (int i = 5; i >= 0; i--) {
+        emitRex(false, 0, saved[i]);
+        emit8(0x58 | (saved[i] & 0x7));
+    }
+    emit8(0xC3);
+
+    // Write the entry, which saves registers, aligns the stack, and loads the globals base
+    block->code = (void(*)())jitPtr;
+    for (int i = 0; i < 6; i++) {
+        emitRex(false, 0, saved[i]);
+        emit8(0x50 | (saved[i] & 0x7));
+    }
+    emitRegOp(true, 0x83, ALU_SUB, RSP);
+    emit8(8);
+    emitMovImm64(RBX, globals);
+
+    // Compile each opcode, falling back to a handler call if it can't be done natively
+    memset(cacheGuest, -1, sizeof(cacheGuest));
+    memset(cacheDirty, 0, sizeof(cacheDirty));
+    uint32_t pc = block->address + (block->thumb ? 4 : 8);
+    for (uint32_t i = 0; i < block->ops.size(); i++, pc += (block->thumb ? 2 : 4)) {
+        const BlockOp &op = block->ops[i];
+        if (!(block->thumb ? compileThumb(op, pc) : compileArm(op, pc)))
+            emitHandler(op, pc, block->thumb);
+    }
+
+    // Leave at the end of the block, pointing to the next opcode
+    emitExit(pc - (block->thumb ? 2 : 4));
+
+#ifndef __linux__
+    // Make the code memory executable again now that the block is done
+    mprotect(jitBase, JIT_SIZE, PROT_READ | PROT_EXEC);
+#endif
+
+    // Let the fault handler see the block's patch sites now that its code is complete
+    patchesReady.store(patchCount, std::memory_order_release);
+    return true;
+}
+
+#else
+
+void Arm9::setJit(bool enable) {
+    // The JIT only generates x86-64 code
+    if (enable) printf("The JIT isn't supported on this platform\n");
+}
+
+void Arm9::resetJit() {
+    // There is no generated code to drop
+}
+
+bool Arm9::compileBlock(Block *block) {
+    // Leave blocks to the interpreter
+    return true;
+}
+
+#endif
@@ -0,0 +1,378 @@
+/*
+    Copyright 2024 Hydr8gon
+
+    This file is part of GamePawd.
+
+    GamePawd is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GamePawd is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "../arm9.h"
+#include "../core.h"
+#include "../display.h"
+#include "../memory.h"
+#include "../state.h"
+
+// Cycles between V-blanks at 108 MHz and 60 Hz
+#define FRAME_CYCLES (108000000 / 60)
+
+// How long each benchmark runs for after warming up
+#define BENCH_TIME 0.5
+
+struct BenchResult {
+    std::string name;
+    double value;
+    const char *unit;
+};
+
+namespace Bench {
+    std::vector<BenchResult> results;
+    uint32_t buffer[854 * 480];
+    uint32_t seed = 1;
+    uint32_t sink;
+
+    uint32_t random();
+    void report(const std::string &name, double value, const char *unit);
+    template <typename F> double timeLoop(F func);
+    void writeResults(FILE *file);
+    void drainFrames();
+    void setupFrame(uint32_t format);
+    void benchConvert();
+    void benchDrawFrame();
+    void benchArm9();
+    void benchMemory();
+    void benchSchedule();
+    void benchState();
+    void benchBoot();
+}
+
+uint32_t Bench::random() {
+    // Generate repeatable pseudo-random values for test data
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+void Bench::report(const std::string &name, double value, const char *unit) {
+    // Record a result, and show progress on stderr so it doesn't mix with the results
+    results.push_back({ name, value, unit });
+    fprintf(stderr, "%-32s %12.3f %s\n", name.c_str(), value, unit);
+}
+
+template <typename F> double Bench::timeLoop(F func) {
+    // Warm up, then run a function for a fixed amount of time and return the seconds per call
+    func();
+    auto start = std::chrono::steady_clock::now();
+    double seconds = 0;
+    uint64_t calls = 0;
+    while (seconds < BENCH_TIME) {
+        func();
+        calls++;
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return seconds / calls;
+}
+
+void Bench::writeResults(FILE *file) {
+    // Write every result as JSON
+    fprintf(file, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        fprintf(file, "    { \"name\": \"%s\", \"value\": %.6f, \"unit\": \"%s\" }%s\n", results[i].name.c_str(),
+            results[i].value, results[i].unit, (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+void Bench::drainFrames() {
+    // Give back every queued frame, since there's no presenter
+    while (uint32_t *frame = Display::getBuffer())
+        Display::releaseBuffer(frame);
+}
+
+void Bench::setupFrame(uint32_t format) {
+    // Fill RAM and the palette with noise so nothing is trivially predictable
+    seed = 1;
+    for (uint32_t i = 0; i < 0x400000; i += 4)
+        Memory::write<uint32_t>(i, random());
+    Display::writePalAddr(~0, 0);
+    for (int i = 0; i < 0x100; i++)
+        Display::writePalData(~0, random());
+
+    // Set up a full-screen framebuffer in the given format
+    Display::writeFbXOfs(~0, 96);
+    Display::writeFbYOfs(~0, 8);
+    Display::writeFbWidth(~0, 854);
+    Display::writeFbHeight(~0, 480);
+    Display::writeFbStride(~0, 854);
+    Display::writeFbAddr(~0, 0x100000);
+    Display::writePixelFmt(~0, format);
+}
+
+void Bench::benchConvert() {
+    // Time full-frame capture and conversion for each pixel format with each level of kernels
+    const char *formats[] = { "palette", "", "argb1555" };
+    const char *levels[] = { "scalar", "sse2", "avx2" };
+    for (uint32_t format = 0; format <= 2; format += 2) {
+        setupFrame(format);
+        void (*lastPal)(uint32_t*, const uint8_t*, uint32_t, const uint32_t*) = nullptr;
+        void (*last555)(uint32_t*, const uint16_t*, uint32_t) = nullptr;
+        for (int level = CONVERT_SCALAR; level <= CONVERT_AVX2; level++) {
+            // Skip levels the host can't run, and ones with no kernel of their own for this format
+            if (!Display::setConvertLevel((ConvertLevel)level) ||
+                (format ? (Display::convert555 == last555) : (Display::convertPal == lastPal))) {
+                fprintf(stderr, "convert/%s/%s unsupported\n", formats[format], levels[level]);
+                continue;
+            }
+            lastPal = Display::convertPal;
+            last555 = Display::convert555;
+            double time = timeLoop([] { Display::renderFrame(buffer); });
+            report(std::string("convert/") + formats[format] + "/" + levels[level], time * 1000, "ms/frame");
+        }
+    }
+    Display::initConvert();
+}
+
+void Bench::benchDrawFrame() {
+    // Time V-blank frame handling when the whole frame changes, when a few rows change, and when nothing does
+    Core::reset();
+    setupFrame(2);
+    Display::drawFrame();
+    drainFrames();
+    uint32_t xOffset = 96;
+    double time = timeLoop([&] {
+        Display::writeFbXOfs(~0, xOffset ^= 1);
+        Display::drawFrame();
+        drainFrames();
+    });
+    report("draw_frame/full", time * 1000, "ms/frame");
+
+    time = timeLoop([] {
+        for (uint32_t i = 0; i < 8; i++)
+            Memory::write<uint16_t>(0x100000 + (random() % 480) * 854 * 2, random());
+        Display::drawFrame();
+        drainFrames();
+    });
+    report("draw_frame/dirty_rows", time * 1000, "ms/frame");
+
+    time = timeLoop([] {
+        Display::drawFrame();
+        drainFrames();
+    });
+    report("draw_frame/unchanged", time * 1000, "ms/frame");
+}
+
+void Bench::benchArm9() {
+    // A loop of ALU, load, store, and branch opcodes, with data in a different page than the code
+    const uint32_t program[] = {
+        0xE3A00000, // mov r0,#0
+        0xE3A03601, // mov r3,#0x100000
+        0xE2800001, // add r0,r0,#1
+        0xE0211000, // eor r1,r1,r0
+        0xE5932000, // ldr r2,[r3]
+        0xE5832004, // str r2,[r3,#4]
+        0xEAFFFFFA // b 0x8
+    };
+
+    // Time the loop with each way of running the CPU
+    const char *modes[] = { "interpreter", "block_cache", "jit" };
+    for (int mode = 0; mode < 3; mode++) {
+        Core::reset();
+        for (uint32_t i = 0; i < sizeof(program) / 4; i++)
+            Memory::write<uint32_t>(i * 4, program[i]);
+        Arm9::setJit(mode == 2);
+        Arm9::setBlockCache(mode >= 1);
+        if (mode == 2 && !Arm9::jit) {
+            fprintf(stderr, "arm9/%s unsupported\n", modes[mode]);
+            continue;
+        }
+        Arm9::reset();
+
+        // Run a frame's worth of cycles at a time, straight through the CPU without the scheduler
+        double time = timeLoop([] { Arm9::runUntil(Arm9::cycles + FRAME_CYCLES); });
+        report(std::string("arm9/") + modes[mode], FRAME_CYCLES / time / 1000000, "Mcycles/s");
+
+        // Count the loop's 5 opcodes per iteration in a frame to report host MIPS as well
+        uint32_t count = *Arm9::registers[0];
+        Arm9::runUntil(Arm9::cycles + FRAME_CYCLES);
+        uint32_t opcodes = (*Arm9::registers[0] - count) * 5;
+        report(std::string("arm9/") + modes[mode] + "_mips", opcodes / time / 1000000, "MIPS");
+    }
+    Arm9::setJit(false);
+    Arm9::setBlockCache(true);
+
+    // A loop polling the interrupt index register, with and without skipping ahead once it's found idle
+    const uint32_t poll[] = {
+        0xE3A0320F, // mov r3,#0xF0000000
+        0xE2833C13, // add r3,r3,#0x1300
+        0xE59310F0, // ldr r1,[r3,#0xF0]
+        0xE3110102, // tst r1,#0x80000000
+        0x0AFFFFFC // beq 0x8
+    };
+    for (int skip = 1; skip >= 0; skip--) {
+        Core::reset();
+        for (uint32_t i = 0; i < sizeof(poll) / 4; i++)
+            Memory::write<uint32_t>(i * 4, poll[i]);
+        Arm9::setIdleSkip(skip);
+        Arm9::reset();
+        double time = timeLoop([] { Arm9::runUntil(Arm9::cycles + FRAME_CYCLES); });
+
+        // Report wall time per emulated frame, and how much of a frame was skipped instead of run
+        std::string name = skip ? "arm9/idle_poll" : "arm9/idle_poll_no_skip";
+        uint64_t idle = Arm9::idleCycles;
+        Arm9::runUntil(Arm9::cycles + FRAME_CYCLES);
+        report(name, time * 1000000, "us/frame");
+        report(name + "_skipped", (Arm9::idleCycles - idle) * 100.0 / FRAME_CYCLES, "%");
+    }
+    Arm9::setIdleSkip(true);
+}
+
+void Bench::benchMemory() {
+    // Prepare random RAM addresses so generating them isn't part of the time
+    Core::reset();
+    seed = 1;
+    static uint32_t addresses[0x1000];
+    for (uint32_t i = 0; i < 0x1000; i++)
+        addresses[i] = random() & 0x3FFFFC;
+
+    // Time RAM reads and writes through the page tables
+    double time = timeLoop([] {
+        for (uint32_t i = 0; i < 0x1000; i++)
+            sink += Memory::read<uint32_t>(addresses[i]);
+    });
+    report("memory/read_ram", time * 1000000000 / 0x1000, "ns/op");
+    time = timeLoop([] {
+        for (uint32_t i = 0; i < 0x1000; i++)
+            Memory::write<uint32_t>(addresses[i], i);
+    });
+    report("memory/write_ram", time * 1000000000 / 0x1000, "ns/op");
+
+    // Time I/O register reads through the dispatch table, as whole words and as bytes
+    time = timeLoop([] {
+        for (uint32_t i = 0; i < 0x1000; i++)
+            sink += Memory::read<uint32_t>(0xF0009460 + (i & 0x4));
+    });
+    report("memory/read_io32", time * 1000000000 / 0x1000, "ns/op");
+    time = timeLoop([] {
+        for (uint32_t i = 0; i < 0x1000; i++)
+            sink += Memory::read<uint8_t>(0xF0009460 + (i & 0x7));
+    });
+    report("memory/read_io8", time * 1000000000 / 0x1000, "ns/op");
+}
+
+void Bench::benchSchedule() {
+    // Keep a set of events pending, like the devices do
+    Core::reset();
+    seed = 1;
+    static int handles[64];
+    for (int i = 0; i < 64; i++) {
+        handles[i] = -1;
+        Core::schedule(handles[i], [] {}, random() % FRAME_CYCLES);
+    }
+
+    // Time pushing events and popping them off the heap as they run
+    // They're spread over a few cycles so the ARM9 barely runs in between
+    double time = timeLoop([] {
+        for (uint32_t i = 0; i < 0x1000; i++)
+            Core::schedule([] {}, random() % 64);
+        Core::runFor(64);
+    });
+    report("schedule/push_pop", time * 1000000000 / 0x1000, "ns/op");
+
+    // Time moving pending events around in the heap
+    time = timeLoop([] {
+        for (uint32_t i = 0; i < 0x1000; i++)
+            Core::schedule(handles[i & 63], [] {}, random() % FRAME_CYCLES);
+    });
+    report("schedule/reschedule", time * 1000000000 / 0x1000, "ns/op");
+
+    // Time repeated requests for an event that's already pending
+    static int unique = -1;
+    time = timeLoop([] {
+        for (uint32_t i = 0; i < 0x1000; i++)
+            Core::scheduleUnique(unique, [] {}, 1000);
+    });
+    report("schedule/coalesce", time * 1000000000 / 0x1000, "ns/op");
+
+    // Time adding and cancelling events
+    time = timeLoop([] {
+        for (uint32_t i = 0; i < 0x1000; i++)
+            Core::cancel(handles[i & 63]);
+        for (uint32_t i = 0; i < 64; i++)
+            Core::schedule(handles[i], [] {}, random() % FRAME_CYCLES);
+    });
+    report("schedule/cancel", time * 1000000000 / (0x1000 + 64), "ns/op");
+    for (int i = 0; i < 64; i++)
+        Core::cancel(handles[i]);
+    Core::cancel(unique);
+}
+
+void Bench::benchState() {
+    // Time taking and loading in-memory snapshots, which reuse their memory after the first
+    Core::reset();
+    static SaveState saved;
+    double time = timeLoop([] { Core::saveState(saved); });
+    report("state/snapshot", time * 1000, "ms/op");
+    time = timeLoop([] { Core::loadState(saved); });
+    report("state/restore", time * 1000, "ms/op");
+}
+
+void Bench::benchBoot() {
+    // Skip booting if there's no firmware, since running garbage says nothing
+    FILE *file = fopen("flash.bin", "rb");
+    if (!file) file = fopen("drc_fw.bin", "rb");
+    if (!file) {
+        fprintf(stderr, "boot skipped, no firmware found\n");
+        return;
+    }
+    fclose(file);
+
+    // Boot the firmware and run it for a fixed number of emulated seconds
+    Core::reset();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 60 * 5; i++) {
+        Core::runFor(FRAME_CYCLES);
+        drainFrames();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    report("boot/wall_time", seconds, "s");
+    report("boot/speed", Core::globalCycles / seconds / 1000000, "Mcycles/s");
+}
+
+int main(int argc, char **argv) {
+    // Run each group of benchmarks, which reset the core as needed, with the block cache like the headless runner
+    Arm9::setBlockCache(true);
+    Core::reset();
+    Bench::benchConvert();
+    Bench::benchDrawFrame();
+    Bench::benchArm9();
+    Bench::benchMemory();
+    Bench::benchSchedule();
+    Bench::benchState();
+    Bench::benchBoot();
+
+    // Write the results to a file if one was given, or to stdout
+    FILE *file = (argc > 1) ? fopen(argv[1], "w") : stdout;
+    if (!file) {
+        fprintf(stderr, "Failed to open %s\n", argv[1]);
+        return 1;
+    }
+    Bench::writeResults(file);
+    if (file != stdout) fclose(file);
+    return 0;
+}
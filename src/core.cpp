@@ -17,7 +17,9 @@
     along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
 */
 
-#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -26,38 +28,69 @@
 #include "display.h"
 #include "dma.h"
 #include "i2c.h"
+#include "input.h"
 #include "interrupts.h"
 #include "memory.h"
+#include "rewind.h"
 #include "spi.h"
+#include "state.h"
 #include "timers.h"
 #include "wifi.h"
 
 struct SchedEvent {
     void (*task)();
-    uint32_t cycles;
+    uint64_t cycles;
+    uint64_t order;
+    int *handle;
 
-    SchedEvent(void (*task)(), uint32_t cycles): task(task), cycles(cycles) {}
-    bool operator<(const SchedEvent &event) const { return cycles < event.cycles; }
+    SchedEvent(void (*task)(), uint64_t cycles, uint64_t order, int *handle = nullptr):
+        task(task), cycles(cycles), order(order), handle(handle) {}
+
+    // Sort by cycles, falling back to insertion order so same-cycle tasks run first in, first out
+    bool operator<(const SchedEvent &event) const
+        { return (cycles != event.cycles) ? (cycles < event.cycles) : (order < event.order); }
 };
 
 namespace Core {
     std::thread *thread;
-    bool running;
+    std::atomic<bool> running;
 
     std::vector<SchedEvent> events;
-    uint32_t globalCycles;
-    uint32_t arm9Cycles;
+    std::vector<std::pair<void (*)(), int*>> tasks;
+    uint64_t eventOrder;
+    uint64_t coalescedEvents;
+    uint64_t globalCycles;
+
+    // Where to cache the state after boot, and how long boot takes
+    std::string bootCacheDir;
+    uint32_t bootCycles;
+    int bootEvent = -1;
+    bool bootLoading;
 
     void runLoop();
-    void resetCycles();
+    void runEvents();
+    void endRun();
+    void saveBootCache();
+    std::string bootCachePath();
+    void syncState(State &state);
+    bool pending(int &handle);
+    void place(uint32_t i, const SchedEvent &event);
+    void siftUp(uint32_t i, const SchedEvent &event);
+    void siftDown(uint32_t i, const SchedEvent &event);
 }
 
 void Core::reset() {
-    // Reset the scheduler
+    // Reset the scheduler, detaching any handles that are still pending
+    for (uint32_t i = 0; i < events.size(); i++)
+        if (events[i].handle) *events[i].handle = -1;
     events.clear();
+    eventOrder = 0;
+    coalescedEvents = 0;
     globalCycles = 0;
-    arm9Cycles = 0;
-    schedule(resetCycles, 0x7FFFFFFF);
+
+    // Forget registered tasks, which each part of the emulator registers again on reset
+    tasks.clear();
+    registerTask(endRun);
 
     // Reset the rest of the emulator
     Display::reset();
@@ -69,55 +102,310 @@ void Core::reset() {
     Timers::reset();
     Wifi::reset();
     Arm9::reset();
+    Rewind::reset();
+    Input::reset();
+
+    // Skip boot by loading the cached state for this firmware, or schedule caching it once boot is done
+    // A cached state that fails to load resets again, so don't try to load it a second time
+    if (bootCacheDir.empty() || !Spi::firmwareHash()) return;
+    registerTask(saveBootCache, &bootEvent);
+    if (bootLoading) return;
+    bootLoading = true;
+    bool loaded = loadStateFile(bootCachePath().c_str());
+    bootLoading = false;
+    if (loaded)
+        printf("Loaded cached boot state from %s\n", bootCachePath().c_str());
+    else
+        schedule(bootEvent, saveBootCache, bootCycles);
+}
+
+void Core::setBootCache(const char *dir, uint32_t cycles) {
+    // Set a directory to cache post-boot states in, or disable caching with null, taking effect on reset
+    bootCacheDir = dir ? dir : "";
+    bootCycles = cycles;
+}
+
+std::string Core::bootCachePath() {
+    // Name cached boot states after the firmware they came from, so changed firmware gets a new one
+    char name[32];
+    snprintf(name, sizeof(name), "/boot-%016llx.state", (unsigned long long)Spi::firmwareHash());
+    return bootCacheDir + name;
+}
+
+void Core::saveBootCache() {
+    // Cache the state now that boot is done
+    if (saveStateFile(bootCachePath().c_str()))
+        printf("Saved cached boot state to %s\n", bootCachePath().c_str());
 }
 
 void Core::start() {
-    // Start the emulation thread if it wasn't running
+    // Start the emulation thread and the render and rewind threads if they weren't running
     if (running) return;
     running = true;
+    Display::startThread();
+    Rewind::startThread();
     thread = new std::thread(runLoop);
 }
 
 void Core::stop() {
-    // Stop the emulation thread if it was running
+    // Stop the emulation thread and then the render and rewind threads if they were running
     if (!running) return;
     running = false;
     thread->join();
     delete thread;
+    Display::stopThread();
+    Rewind::stopThread();
 }
 
 void Core::runLoop() {
     // Run the emulator
-    while (running) {
-        // Run the ARM9 until the next scheduled task
-        globalCycles = arm9Cycles;
-        while (events[0].cycles > globalCycles)
-            globalCycles = (arm9Cycles += Arm9::runOpcode());
-
-        // Run all tasks that are scheduled now
-        globalCycles = events[0].cycles;
-        while (events[0].cycles == globalCycles) {
-            events[0].task();
-            events.erase(events.begin());
+    while (running)
+        runEvents();
+}
+
+void Core::runFor(uint32_t cycles) {
+    // Run the emulator on the calling thread, with an empty task to land exactly on the end
+    uint64_t end = schedule(endRun, cycles);
+    while (globalCycles < end)
+        runEvents();
+}
+
+void Core::endRun() {
+    // Mark the end of a run, doing nothing
+}
+
+void Core::runEvents() {
+    // Run the ARM9 until the next scheduled task, handing over a new deadline if it moves
+    while (events[0].cycles > Arm9::cycles)
+        Arm9::runUntil(events[0].cycles);
+
+    // Run all tasks that are scheduled now
+    globalCycles = events[0].cycles;
+    while (events[0].cycles == globalCycles) {
+        // Pop the task off the heap before running it, in case it schedules more
+        void (*task)() = events[0].task;
+        if (events[0].handle) *events[0].handle = -1;
+        SchedEvent last = events.back();
+        events.pop_back();
+        if (!events.empty()) siftDown(0, last);
+        task();
+    }
+}
+
+bool Core::pending(int &handle) {
+    // Check if a handle refers to an event that's still in the heap
+    return handle >= 0 && handle < int(events.size()) && events[handle].handle == &handle;
+}
+
+void Core::place(uint32_t i, const SchedEvent &event) {
+    // Store an event in the heap and keep its handle pointing at it
+    events[i] = event;
+    if (event.handle) *event.handle = i;
+}
+
+void Core::siftUp(uint32_t i, const SchedEvent &event) {
+    // Move a hole up the heap until the event fits, then fill it
+    while (i > 0) {
+        uint32_t parent = (i - 1) >> 1;
+        if (!(event < events[parent])) break;
+        place(i, events[parent]);
+        i = parent;
+    }
+    place(i, event);
+}
+
+void Core::siftDown(uint32_t i, const SchedEvent &event) {
+    // Move a hole down the heap until the event fits, then fill it
+    uint32_t size = events.size();
+    while (true) {
+        uint32_t child = (i << 1) + 1;
+        if (child >= size) break;
+        if (child + 1 < size && events[child + 1] < events[child]) child++;
+        if (!(events[child] < event)) break;
+        place(i, events[child]);
+        i = child;
+    }
+    place(i, event);
+}
+
+uint64_t Core::schedule(void (*task)(), uint32_t cycles) {
+    // Add a task to the scheduler's binary min-heap, ordered by least to most cycles until execution
+    SchedEvent event(task, globalCycles + cycles, eventOrder++);
+    events.push_back(event);
+    siftUp(events.size() - 1, event);
+
+    // Cut the ARM9's current run short if the task comes before its deadline
+    if (event.cycles < Arm9::deadline)
+        Arm9::deadline = event.cycles;
+    return event.cycles;
+}
+
+uint64_t Core::schedule(int &handle, void (*task)(), uint32_t cycles) {
+    // Add a task to the scheduler if its handle is free, or move the pending event in place
+    SchedEvent event(task, globalCycles + cycles, eventOrder++, &handle);
+    if (!pending(handle)) {
+        events.push_back(event);
+        siftUp(events.size() - 1, event);
+    }
+    else if (handle > 0 && event < events[(handle - 1) >> 1]) {
+        siftUp(handle, event);
+    }
+    else {
+        siftDown(handle, event);
+    }
+
+    // Cut the ARM9's current run short if the task comes before its deadline
+    if (event.cycles < Arm9::deadline)
+        Arm9::deadline = event.cycles;
+    return event.cycles;
+}
+
+uint64_t Core::scheduleUnique(int &handle, void (*task)(), uint32_t cycles) {
+    // Skip adding a task if it's already pending at the same time or earlier
+    if (pending(handle) && events[handle].cycles <= cycles + globalCycles) {
+        coalescedEvents++;
+        return events[handle].cycles;
+    }
+
+    // Otherwise schedule it, moving a later pending instance up if there is one
+    return schedule(handle, task, cycles);
+}
+
+void Core::cancel(int &handle) {
+    // Remove a pending event from the scheduler, filling its slot with the last event
+    if (!pending(handle)) return;
+    uint32_t i = handle;
+    SchedEvent last = events.back();
+    events.pop_back();
+    handle = -1;
+    if (i == events.size()) return;
+    if (i > 0 && last < events[(i - 1) >> 1])
+        siftUp(i, last);
+    else
+        siftDown(i, last);
+}
+
+void Core::registerTask(void (*task)(), int *handle) {
+    // Register a task that can be scheduled, along with its handle if it has one, so save states can refer to it
+    tasks.push_back(std::make_pair(task, handle));
+}
+
+void Core::syncState(State &state) {
+    // Save or load the cycle counts
+    state.sync(globalCycles);
+    state.sync(eventOrder);
+    state.sync(coalescedEvents);
+
+    // Detach handles from the current events before loading new ones
+    uint32_t count = events.size();
+    state.sync(count);
+    if (state.loading) {
+        for (uint32_t i = 0; i < events.size(); i++)
+            if (events[i].handle) *events[i].handle = -1;
+        events.clear();
+    }
+
+    // Save or load events in heap order, referring to tasks by their registered index
+    for (uint32_t i = 0; i < count && !state.failed; i++) {
+        SchedEvent event = state.loading ? SchedEvent(endRun, 0, 0) : events[i];
+        int32_t index = -1;
+        uint8_t handled = (event.handle != nullptr);
+        for (uint32_t j = 0; j < tasks.size() && !state.loading; j++)
+            if (tasks[j].first == event.task) index = j;
+        if (index < 0 && !state.loading) {
+            // Save unknown tasks as empty ones, since they can't be restored
+            printf("Saving unregistered scheduler task as an empty one\n");
+            index = 0;
+            handled = 0;
         }
+        state.sync(index);
+        state.sync(event.cycles);
+        state.sync(event.order);
+        state.sync(handled);
+        if (!state.loading) continue;
+
+        // Rebuild events from their tasks, reattaching the handles they were registered with
+        if (index < 0 || index >= int32_t(tasks.size())) {
+            state.failed = true;
+            break;
+        }
+        event.task = tasks[index].first;
+        if (handled)
+            event.handle = tasks[index].second;
+        events.push_back(event);
+        place(i, event);
     }
 }
 
-void Core::resetCycles() {
-    // Reset cycle counts periodically to prevent overflow
-    for (uint32_t i = 0; i < events.size(); i++)
-        events[i].cycles -= globalCycles;
-    Timers::timerCycles -= globalCycles;
-    Timers::countCycles -= globalCycles;
-    arm9Cycles -= globalCycles;
-    globalCycles -= globalCycles;
-    schedule(resetCycles, 0x7FFFFFFF);
-}
-
-uint32_t Core::schedule(void (*task)(), uint32_t cycles) {
-    // Add a task to the scheduler, sorted by least to most cycles until execution
-    SchedEvent event(task, cycles += globalCycles);
-    auto it = std::upper_bound(events.cbegin(), events.cend(), event);
-    events.insert(it, event);
-    return cycles;
+void Core::saveDevices(std::vector<uint8_t> &data) {
+    // Save the state of every part of the emulator except RAM, reusing the buffer's memory if possible
+    // This must be called while the emulator is stopped, or from the emulation thread
+    data.clear();
+    State state(&data, false);
+    syncState(state);
+    Arm9::syncState(state);
+    Display::syncState(state);
+    Dma::syncState(state);
+    I2c::syncState(state);
+    Interrupts::syncState(state);
+    Spi::syncState(state);
+    Timers::syncState(state);
+    Wifi::syncState(state);
+}
+
+bool Core::loadDevices(const std::vector<uint8_t> &data) {
+    // Load the state of every part of the emulator except RAM, which should already be in place
+    // This must be called while the emulator is stopped, or from the emulation thread
+    State state(const_cast<std::vector<uint8_t>*>(&data), true);
+    syncState(state);
+    Arm9::syncState(state);
+    Display::syncState(state);
+    Dma::syncState(state);
+    I2c::syncState(state);
+    Interrupts::syncState(state);
+    Spi::syncState(state);
+    Timers::syncState(state);
+    Wifi::syncState(state);
+
+    // Start over if the state didn't fit, since the emulator is left half-loaded
+    if (state.failed || state.offset != data.size() || events.empty()) {
+        printf("Invalid save state, resetting\n");
+        reset();
+        return false;
+    }
+    return true;
+}
+
+void Core::saveState(SaveState &saved) {
+    // Save the state of every part of the emulator, then copy RAM as a whole
+    saveDevices(saved.devices);
+    saved.ram.resize(0x400000);
+    memcpy(saved.ram.data(), Memory::ram, 0x400000);
+}
+
+bool Core::loadState(const SaveState &saved) {
+    // Reject snapshots without a full copy of RAM
+    if (saved.ram.size() != 0x400000) {
+        printf("Invalid save state\n");
+        return false;
+    }
+
+    // Load RAM, then the state of every part of the emulator, and restart rewind history from here
+    memcpy(Memory::ram, saved.ram.data(), 0x400000);
+    if (!loadDevices(saved.devices)) return false;
+    Rewind::restart();
+    return true;
+}
+
+bool Core::saveStateFile(const char *path) {
+    // Take a snapshot and write it to a file
+    SaveState saved;
+    saveState(saved);
+    return saved.write(path);
+}
+
+bool Core::loadStateFile(const char *path) {
+    // Read a snapshot from a file and load it
+    SaveState saved;
+    return saved.read(path) && loadState(saved);
 }
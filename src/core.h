@@ -19,11 +19,33 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+struct SaveState;
+
 namespace Core {
-    extern uint32_t globalCycles;
-    uint32_t schedule(void (*task)(), uint32_t cycles);
+    extern std::atomic<bool> running;
+    extern uint64_t globalCycles;
+    extern uint64_t coalescedEvents;
+
+    uint64_t schedule(void (*task)(), uint32_t cycles);
+    uint64_t schedule(int &handle, void (*task)(), uint32_t cycles);
+    uint64_t scheduleUnique(int &handle, void (*task)(), uint32_t cycles);
+    void cancel(int &handle);
+    void registerTask(void (*task)(), int *handle = nullptr);
+
+    void saveDevices(std::vector<uint8_t> &data);
+    bool loadDevices(const std::vector<uint8_t> &data);
+    void saveState(SaveState &saved);
+    bool loadState(const SaveState &saved);
+    bool saveStateFile(const char *path);
+    bool loadStateFile(const char *path);
+    void setBootCache(const char *dir, uint32_t cycles);
 
     void reset();
     void start();
     void stop();
+    void runFor(uint32_t cycles);
 }
@@ -17,36 +17,59 @@
     along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <cstdlib>
+
 #include "gp_app.h"
+#include "../display.h"
+#include "../input.h"
+#include "../rewind.h"
 
 enum AppEvent {
     UPDATE = 1
 };
 
 wxBEGIN_EVENT_TABLE(gpApp, wxApp)
-EVT_TIMER(UPDATE, gpApp::update)
+EVT_THREAD(UPDATE, gpApp::update)
 wxEND_EVENT_TABLE()
 
 int gpApp::keyBinds[] = { 'S', 'W', 'D', 'A', 'I', 'O', 'K', 'L', 'V', 'B', 'G', 'H', 'P', 'Q', '0', '1' };
+std::atomic<bool> gpApp::refreshPending;
 
 bool gpApp::OnInit() {
-    // Create the app's frame
+    // Get notified of new frames before the core starts making them
     SetAppName("GamePawd");
-    frame = new gpFrame();
+    Display::setFrameCallback(frameReady);
+
+    // Record input to a file or replay it from one if asked to, and keep rewind history if asked for
+    // Rewinding protects every RAM page again each frame, sending the first write to each one through the slow path, so it stays opt-in
+    for (int i = 1; i + 1 < argc; i++) {
+        if (argv[i] == "--record")
+            Input::setRecord(argv[++i].mb_str());
+        else if (argv[i] == "--replay" && !Input::setReplay(argv[++i].mb_str()))
+            return false;
+        else if (argv[i] == "--rewind")
+            Rewind::setLimits(strtoul(argv[++i].mb_str(), nullptr, 0), 64 << 20);
+    }
 
-    // Set up the update timer
-    timer = new wxTimer(this, UPDATE);
-    timer->Start(6);
+    // Create the app's frame
+    frame = new gpFrame();
     return true;
 }
 
 int gpApp::OnExit() {
-    // Stop the timer before exiting
-    timer->Stop();
+    // Stop getting notified of new frames before exiting
+    Display::setFrameCallback(nullptr);
     return wxApp::OnExit();
 }
 
-void gpApp::update(wxTimerEvent &event) {
-    // Continuously refresh the frame
+void gpApp::frameReady() {
+    // Ask the GUI thread to refresh the frame, unless a request is already waiting
+    if (!refreshPending.exchange(true))
+        wxQueueEvent(wxTheApp, new wxThreadEvent(wxEVT_THREAD, UPDATE));
+}
+
+void gpApp::update(wxThreadEvent &event) {
+    // Refresh the frame to present the new framebuffer, taking requests for any that come after
+    refreshPending = false;
     frame->Refresh();
 }
@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <atomic>
+
 #include "gp_frame.h"
 
 #define MAX_KEYS 16
@@ -26,14 +28,15 @@
 class gpApp: public wxApp {
 public:
     static int keyBinds[MAX_KEYS];
+    static void frameReady();
 
 private:
+    static std::atomic<bool> refreshPending;
     gpFrame *frame;
-    wxTimer *timer;
 
     bool OnInit();
     int OnExit();
 
-    void update(wxTimerEvent &event);
+    void update(wxThreadEvent &event);
     wxDECLARE_EVENT_TABLE();
 };
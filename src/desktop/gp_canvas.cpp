@@ -17,14 +17,29 @@
     along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <cstdio>
+#include <cstring>
+
 #include "gp_canvas.h"
 #include "gp_app.h"
 #include "../display.h"
-#include "../spi.h"
+#include "../input.h"
+#include "../rewind.h"
 
 #ifdef _WIN32
-#include <GL/gl.h>
-#include <GL/glext.h>
+// Declare OpenGL functions past 1.1, which have to be loaded at runtime on Windows
+#define GL_FUNCTIONS(X) \
+    X(PFNGLGENBUFFERSPROC, glGenBuffers) \
+    X(PFNGLBINDBUFFERPROC, glBindBuffer) \
+    X(PFNGLBUFFERDATAPROC, glBufferData) \
+    X(PFNGLMAPBUFFERRANGEPROC, glMapBufferRange) \
+    X(PFNGLUNMAPBUFFERPROC, glUnmapBuffer) \
+    X(PFNGLFENCESYNCPROC, glFenceSync) \
+    X(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync) \
+    X(PFNGLDELETESYNCPROC, glDeleteSync)
+#define DECLARE_FUNCTION(type, name) static type name;
+#define LOAD_FUNCTION(type, name) name = (type)wglGetProcAddress(#name);
+GL_FUNCTIONS(DECLARE_FUNCTION)
 #endif
 
 wxBEGIN_EVENT_TABLE(gpCanvas, wxGLCanvas)
@@ -40,6 +55,81 @@ gpCanvas::gpCanvas(gpFrame *frame): wxGLCanvas(frame, wxID_ANY, nullptr), frame(
     SetFocus();
 }
 
+void gpCanvas::printStats() {
+    // Report how long frames took to upload and present on average
+    if (uploadCount)
+        printf("Average upload time: %.3f ms\n", uploadTime * 1000 / uploadCount);
+    if (presentCount)
+        printf("Average present time: %.3f ms\n", presentTime * 1000 / presentCount);
+}
+
+void gpCanvas::setup() {
+#ifdef _WIN32
+    // Load the OpenGL functions that aren't exported directly
+    GL_FUNCTIONS(LOAD_FUNCTION)
+#endif
+
+    // Prepare a texture for the framebuffer, allocating its storage once
+    glEnable(GL_TEXTURE_2D);
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, MIN_SIZE.x, MIN_SIZE.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+
+    // Prepare pixel buffers to stream frames through
+    glGenBuffers(PBO_COUNT, pixelBuffers);
+    for (int i = 0; i < PBO_COUNT; i++) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffers[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, MIN_SIZE.x * MIN_SIZE.y * 4, nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    // Prepare a vertex buffer for the quad, which gets filled when the canvas is sized
+    glGenBuffers(1, &vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glVertexPointer(2, GL_FLOAT, 4 * sizeof(GLfloat), (void*)0);
+    glTexCoordPointer(2, GL_FLOAT, 4 * sizeof(GLfloat), (void*)(2 * sizeof(GLfloat)));
+    frame->SendSizeEvent();
+}
+
+void gpCanvas::waitFence(GLsync &fence) {
+    // Wait for the GPU to pass a fence, then free it
+    if (!fence) return;
+    glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    glDeleteSync(fence);
+    fence = nullptr;
+}
+
+void gpCanvas::upload(uint32_t *buffer) {
+    // Wait until the GPU is done copying from the next pixel buffer, then fill it with the frame
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    waitFence(uploadFences[pboIndex]);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffers[pboIndex]);
+    uint32_t size = MIN_SIZE.x * MIN_SIZE.y * 4;
+    if (void *data = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT)) {
+        memcpy(data, buffer, size);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+
+    // Give the frame back early, since the pixel buffer holds a copy now
+    Display::releaseBuffer(buffer);
+
+    // Update the texture in place from the pixel buffer, and fence the copy so the buffer isn't reused too soon
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, MIN_SIZE.x, MIN_SIZE.y, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    uploadFences[pboIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    pboIndex = (pboIndex + 1) % PBO_COUNT;
+
+    // Track how long the upload took on the CPU side
+    uploadTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uploadCount++;
+}
+
 void gpCanvas::draw(wxPaintEvent &event) {
     // Set the render context and clear the screen
     SetCurrent(*context);
@@ -47,57 +137,30 @@ void gpCanvas::draw(wxPaintEvent &event) {
     glClear(GL_COLOR_BUFFER_BIT);
 
     // Run initial setup once
-    static bool setup = false;
-    if (!setup) {
-        // Prepare a texture for the framebuffer
-        GLuint texture;
-        glEnable(GL_TEXTURE_2D);
-        glGenTextures(1, &texture);
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        // Finish initial setup
-        frame->SendSizeEvent();
-        setup = true;
+    if (!texture)
+        setup();
+
+    // Stream exactly one queued framebuffer into the texture per paint, so a full queue makes the core wait on V-sync
+    // The unchanged marker leaves the texture as it is, and another paint is requested in case more frames are waiting
+    if (uint32_t *buffer = Display::getBuffer()) {
+        if (Display::isUnchanged(buffer))
+            Display::releaseBuffer(buffer);
+        else
+            upload(buffer);
+        gpApp::frameReady();
     }
 
-    // At the swap interval, get the framebuffer as a texture
-    if (++frameCount >= swapInterval) {
-        if (uint32_t *buffer = Display::getBuffer()) {
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, MIN_SIZE.x, MIN_SIZE.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
-            frameCount = 0;
-            delete buffer;
-        }
-    }
-
-    // Submit the polygon vertices
-    glBegin(GL_QUADS);
-    glTexCoord2i(1, 1);
-    glVertex2i(x + width, y + height);
-    glTexCoord2i(0, 1);
-    glVertex2i(x, y + height);
-    glTexCoord2i(0, 0);
-    glVertex2i(x, y);
-    glTexCoord2i(1, 0);
-    glVertex2i(x + width, y);
-    glEnd();
-
-    // Track the refresh rate and update the swap interval every second
-    // Speed is limited by drawing, so this tries to keep it at 60 Hz
-    refreshRate++;
-    std::chrono::duration<double> rateTime = std::chrono::steady_clock::now() - lastRateTime;
-    if (rateTime.count() >= 1.0f) {
-        swapInterval = (refreshRate + 5) / 60; // Margin of 5
-        refreshRate = 0;
-        lastRateTime = std::chrono::steady_clock::now();
-    }
+    // Draw the quad from the vertex buffer
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
 
-    // Finish the frame
-    glFinish();
+    // Wait for the last frame to finish so the CPU stays at most one frame ahead, then present this one
+    // Frames are drawn as the core makes them, so presentation follows V-sync without guessing an interval
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    waitFence(presentFence);
     SwapBuffers();
+    presentFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    presentTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    presentCount++;
 }
 
 void gpCanvas::resize(wxSizeEvent &event) {
@@ -123,18 +186,33 @@ void gpCanvas::resize(wxSizeEvent &event) {
         x = 0;
         y = (size.y - height) / 2;
     }
+
+    // Update the quad's vertices and texture coordinates if the vertex buffer exists yet
+    if (!vertexBuffer) return;
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    GLfloat vertices[] = {
+        GLfloat(x + width), GLfloat(y + height), 1, 1,
+        GLfloat(x), GLfloat(y + height), 0, 1,
+        GLfloat(x), GLfloat(y), 0, 0,
+        GLfloat(x + width), GLfloat(y), 1, 0
+    };
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
 }
 
 void gpCanvas::pressKey(wxKeyEvent &event) {
+    // Step back a second when backspace is pressed
+    if (event.GetKeyCode() == WXK_BACK)
+        Rewind::request(60);
+
     // Trigger a key press if a mapped key was pressed
     for (int i = 0; i < MAX_KEYS; i++)
         if (event.GetKeyCode() == gpApp::keyBinds[i])
-            Spi::pressKey(i);
+            Input::pressKey(i);
 }
 
 void gpCanvas::releaseKey(wxKeyEvent &event) {
     // Trigger a key release if a mapped key was released
     for (int i = 0; i < MAX_KEYS; i++)
         if (event.GetKeyCode() == gpApp::keyBinds[i])
-            Spi::releaseKey(i);
+            Input::releaseKey(i);
 }
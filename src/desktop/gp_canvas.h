@@ -21,13 +21,23 @@
 
 #include <chrono>
 #include <wx/wx.h>
+
+// Use OpenGL functions past 1.1 directly where the system library exports them
+#ifndef _WIN32
+#define GL_GLEXT_PROTOTYPES
+#endif
 #include <wx/glcanvas.h>
+#include <GL/glext.h>
+
+// Enough pixel buffers to fill one while the GPU copies from the others
+#define PBO_COUNT 3
 
 class gpFrame;
 
 class gpCanvas: public wxGLCanvas {
 public:
     gpCanvas(gpFrame *frame);
+    void printStats();
 
 private:
     gpFrame *frame;
@@ -38,11 +48,21 @@ private:
     uint32_t x = 0;
     uint32_t y = 0;
 
-    int frameCount = 0;
-    int swapInterval = 0;
-    int refreshRate = 0;
-    std::chrono::steady_clock::time_point lastRateTime;
+    GLuint texture = 0;
+    GLuint vertexBuffer = 0;
+    GLuint pixelBuffers[PBO_COUNT] = {};
+    GLsync uploadFences[PBO_COUNT] = {};
+    GLsync presentFence = nullptr;
+    int pboIndex = 0;
+
+    double uploadTime = 0;
+    double presentTime = 0;
+    int uploadCount = 0;
+    int presentCount = 0;
 
+    void setup();
+    void upload(uint32_t *buffer);
+    void waitFence(GLsync &fence);
     void draw(wxPaintEvent &event);
     void resize(wxSizeEvent &event);
     void pressKey(wxKeyEvent &event);
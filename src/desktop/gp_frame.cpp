@@ -20,6 +20,8 @@
 #include "gp_frame.h"
 #include "gp_canvas.h"
 #include "../core.h"
+#include "../input.h"
+#include "../rewind.h"
 
 wxBEGIN_EVENT_TABLE(gpFrame, wxFrame)
 EVT_CLOSE(gpFrame::close)
@@ -27,7 +29,7 @@ wxEND_EVENT_TABLE()
 
 gpFrame::gpFrame(): wxFrame(nullptr, wxID_ANY, "GamePawd") {
     // Set up a canvas for drawing the framebuffer
-    gpCanvas *canvas = new gpCanvas(this);
+    canvas = new gpCanvas(this);
     wxBoxSizer *sizer = new wxBoxSizer(wxHORIZONTAL);
     sizer->Add(canvas, 1, wxEXPAND);
     SetSizer(sizer);
@@ -44,7 +46,10 @@ gpFrame::gpFrame(): wxFrame(nullptr, wxID_ANY, "GamePawd") {
 }
 
 void gpFrame::close(wxCloseEvent &event) {
-    // Stop emulation before exiting
+    // Stop emulation and save any recorded input before exiting, then report frame and rewind stats
     Core::stop();
+    Input::writeLog();
+    canvas->printStats();
+    Rewind::printStats();
     event.Skip(true);
 }
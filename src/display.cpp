@@ -18,21 +18,77 @@
 */
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
 #include <mutex>
-#include <queue>
 #include <thread>
-#include <vector>
 
 #include "display.h"
 #include "core.h"
 #include "interrupts.h"
 #include "memory.h"
+#include "state.h"
+
+// Enough framebuffers for a full queue, one being presented, and one being drawn
+#define QUEUE_SIZE 3
+#define FRAME_COUNT (QUEUE_SIZE + 2)
+
+// Enough captured frames for one being converted and one waiting
+#define JOB_COUNT 2
+
+// Everything needed to convert a frame, captured at V-blank so the core can move on
+struct FrameJob {
+    uint32_t palette[0x100];
+    uint8_t rows[480][854 * 2];
+    uint8_t rowMask[480];
+    uint32_t x0, count;
+    int32_t xOfs;
+    uint8_t format;
+    bool clear;
+    bool unchanged;
+};
 
 namespace Display {
-    std::queue<uint32_t*> buffers;
-    std::mutex mutex;
+    uint32_t frames[FRAME_COUNT][854 * 480];
+    FramePolicy framePolicy = FRAME_BLOCK;
+    void (*frameCallback)() = nullptr;
+    uint32_t *spareBuffer;
+    uint32_t unchangedMarker;
+
+    // Frames queued by the core for the presenter, which the core can also take back when dropping
+    std::atomic<uint32_t*> queued[QUEUE_SIZE];
+    std::atomic<uint32_t> queueHead;
+    std::atomic<uint32_t> queueTail;
+
+    // Frames given back by the presenter for the core to reuse
+    uint32_t *released[FRAME_COUNT];
+    std::atomic<uint32_t> releaseHead;
+    uint32_t releaseTail;
+
+    // Captured frames handed from the core to the render thread
+    FrameJob jobs[JOB_COUNT];
+    uint32_t jobHead;
+    uint32_t jobTail;
+    std::mutex jobMutex;
+    std::condition_variable jobCond;
+    std::thread *renderThread;
+    bool rendering;
+
+    // The last rendered frame and which frame each pool buffer and screen row were last updated in
+    // Buffers are brought up to date by copying only the rows that changed since the frame they hold
+    uint32_t *lastBuffer;
+    uint32_t frameSerial;
+    uint32_t bufferSerials[FRAME_COUNT];
+    uint32_t rowSerials[480];
+
+    // The RAM pages under the last frame, and the ones that were written since
+    uint8_t framePages[0x400];
+    uint8_t dirtyPages[0x400];
+    bool anyDirty;
+    bool redraw;
 
     uint32_t palette[0x100];
     uint32_t fbXOffset;
@@ -43,11 +99,40 @@ namespace Display {
     uint32_t fbAddress;
     uint32_t pixelFormat;
     uint8_t palAddress;
-
-    void drawFrame();
+    int frameEvent = -1;
+
+    uint32_t *takeBuffer();
+    void queueBuffer(uint32_t *buffer);
+    uint32_t getColumns(uint32_t &x0, uint32_t &count);
+    bool rowDirty(uint32_t address, uint32_t size);
+    void captureFrame(FrameJob &job, bool dirtyOnly);
+    void convertFrame(uint32_t *buffer, const FrameJob &job);
+    void presentJob(const FrameJob &job);
+    void renderLoop();
+    bool watchFrame();
+    void writeReg(uint32_t &reg, uint32_t mask, uint32_t value);
 }
 
 void Display::reset() {
+    // Fill the framebuffer pool the first time; after that, buffers are always in circulation
+    static bool pooled = false;
+    if (!pooled) {
+        for (int i = 0; i < FRAME_COUNT; i++)
+            released[i] = frames[i];
+        releaseHead.store(FRAME_COUNT, std::memory_order_release);
+        pooled = true;
+    }
+
+    // Pick conversion kernels the first time
+    if (!convertPal)
+        initConvert();
+
+    // Forget the last frame; RAM pages stop being watched when memory is reset
+    memset(framePages, 0, sizeof(framePages));
+    memset(dirtyPages, 0, sizeof(dirtyPages));
+    anyDirty = false;
+    redraw = true;
+
     // Reset the palette and registers
     memset(palette, 0, sizeof(palette));
     fbXOffset = 0;
@@ -59,81 +144,367 @@ void Display::reset() {
     pixelFormat = 0;
     palAddress = 0;
 
+    // Register the display I/O registers
+    Memory::registerRead(0xF0009410, 4, IO_READ(readFbXOfs)); // Stub
+    Memory::registerRead(0xF0009460, 4, IO_READ(readFbXOfs));
+    Memory::registerRead(0xF0009464, 4, IO_READ(readFbWidth));
+    Memory::registerRead(0xF0009468, 4, IO_READ(readFbYOfs));
+    Memory::registerRead(0xF000946C, 4, IO_READ(readFbHeight));
+    Memory::registerRead(0xF0009474, 4, IO_READ(readFbAddr));
+    Memory::registerWrite(0xF0009460, 4, IO_WRITE(writeFbXOfs));
+    Memory::registerWrite(0xF0009464, 4, IO_WRITE(writeFbWidth));
+    Memory::registerWrite(0xF0009468, 4, IO_WRITE(writeFbYOfs));
+    Memory::registerWrite(0xF000946C, 4, IO_WRITE(writeFbHeight));
+    Memory::registerWrite(0xF0009470, 4, IO_WRITE(writeFbStride));
+    Memory::registerWrite(0xF0009474, 4, IO_WRITE(writeFbAddr));
+    Memory::registerWrite(0xF00094B0, 4, IO_WRITE(writePixelFmt));
+    Memory::registerWrite(0xF0009500, 4, IO_WRITE(writePalAddr));
+    Memory::registerWrite(0xF0009504, 4, IO_WRITE(writePalData));
+
     // Schedule initial tasks
-    Core::schedule(drawFrame, 108000000 / 60);
+    Core::registerTask(drawFrame, &frameEvent);
+    Core::schedule(frameEvent, drawFrame, 108000000 / 60);
+}
+
+void Display::syncState(State &state) {
+    // Save or load the palette and registers
+    state.sync(palette);
+    state.sync(fbXOffset);
+    state.sync(fbWidth);
+    state.sync(fbYOffset);
+    state.sync(fbHeight);
+    state.sync(fbStride);
+    state.sync(fbAddress);
+    state.sync(pixelFormat);
+    state.sync(palAddress);
+
+    // Render the whole frame next time, since nothing about the last one can be trusted
+    if (state.loading) redraw = true;
+}
+
+void Display::setFramePolicy(FramePolicy policy) {
+    // Set what the core does with a new frame when the queue is full
+    framePolicy = policy;
+}
+
+void Display::setFrameCallback(void (*callback)()) {
+    // Set a function to call whenever a new frame is queued, from whichever thread queued it
+    frameCallback = callback;
+}
+
+bool Display::isUnchanged(const uint32_t *buffer) {
+    // Check if a queued buffer is the marker for a frame where nothing changed
+    return buffer == &unchangedMarker;
 }
 
 uint32_t *Display::getBuffer() {
-    // Get the next framebuffer for display if one is queued
-    uint32_t *buffer = nullptr;
-    mutex.lock();
-    if (!buffers.empty()) {
-        buffer = buffers.front();
-        buffers.pop();
+    // Get the next framebuffer for display if one is queued, which might be the unchanged marker
+    // The core can drop the same frame at the same time, so it has to be claimed
+    uint32_t *buffer;
+    uint32_t tail = queueTail.load(std::memory_order_relaxed);
+    do {
+        if (tail == queueHead.load(std::memory_order_acquire))
+            return nullptr;
+        buffer = queued[tail % QUEUE_SIZE].load(std::memory_order_relaxed);
     }
-    mutex.unlock();
+    while (!queueTail.compare_exchange_weak(tail, tail + 1, std::memory_order_acq_rel));
     return buffer;
 }
 
-void Display::drawFrame() {
-    // Create a new framebuffer and clear it
-    uint32_t *buffer = new uint32_t[854 * 480];
-    memset(buffer, 0, 854 * 480 * 4);
+void Display::releaseBuffer(uint32_t *buffer) {
+    // Return a framebuffer to the pool once it's been displayed, ignoring the unchanged marker
+    if (isUnchanged(buffer)) return;
+    uint32_t head = releaseHead.load(std::memory_order_relaxed);
+    released[head % FRAME_COUNT] = buffer;
+    releaseHead.store(head + 1, std::memory_order_release);
+}
 
-    // Render a buffer from memory with the current parameters
-    uint32_t w = std::min(fbWidth, 854U), h = std::min(fbHeight, 480U);
-    switch (uint8_t fmt = pixelFormat & 0x3) {
-    case 0: // 8-bit palette
-        for (int y = 0; y < h; y++) {
-            for (int x = 0; x < w; x++) {
-                // Check bounds for the current pixel
-                uint32_t fbY, fbX;
-                if ((fbY = y + fbYOffset - 8) >= 480) break;
-                if ((fbX = x + fbXOffset - 96) >= 854) continue;
-
-                // Look up a color with an 8-bit palette index
-                buffer[fbY * 854 + fbX] = palette[Memory::read<uint8_t>(fbAddress + y * fbStride + x)];
+uint32_t *Display::takeBuffer() {
+    // Reuse a framebuffer the core held on to, if there is one
+    if (uint32_t *buffer = spareBuffer) {
+        spareBuffer = nullptr;
+        return buffer;
+    }
+
+    // Take a framebuffer given back by the presenter, waiting if they're all in use
+    while (releaseTail == releaseHead.load(std::memory_order_acquire))
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return released[releaseTail++ % FRAME_COUNT];
+}
+
+void Display::queueBuffer(uint32_t *buffer) {
+    // Handle a full queue based on the frame policy
+    uint32_t head = queueHead.load(std::memory_order_relaxed);
+    uint32_t tail;
+    while (head - (tail = queueTail.load(std::memory_order_acquire)) >= QUEUE_SIZE) {
+        switch (framePolicy) {
+        case FRAME_BLOCK:
+            // Wait for the presenter to make room, or skip the frame if the core is being stopped
+            if (Core::running) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                break;
             }
+            if (!isUnchanged(buffer)) spareBuffer = buffer;
+            return;
+
+        case FRAME_OVERWRITE:
+            // Keep the new frame and draw over it next time
+            if (!isUnchanged(buffer)) spareBuffer = buffer;
+            return;
+
+        case FRAME_DROP:
+            // Take back the oldest frame for reuse, unless the presenter just got it or it's the unchanged marker
+            spareBuffer = queued[tail % QUEUE_SIZE].load(std::memory_order_relaxed);
+            if (!queueTail.compare_exchange_strong(tail, tail + 1, std::memory_order_acq_rel) || isUnchanged(spareBuffer))
+                spareBuffer = nullptr;
+            break;
+        }
+    }
+
+    // Add the frame to the queue
+    queued[head % QUEUE_SIZE].store(buffer, std::memory_order_relaxed);
+    queueHead.store(head + 1, std::memory_order_release);
+
+    // Let the presenter know there's a new frame
+    if (frameCallback)
+        (*frameCallback)();
+}
+
+uint32_t Display::getColumns(uint32_t &x0, uint32_t &count) {
+    // Find the range of framebuffer columns that land on screen, and return the X-offset
+    uint32_t w = std::min(fbWidth, 854U);
+    int32_t xOfs = fbXOffset - 96;
+    x0 = std::min<int64_t>(std::max<int64_t>(-int64_t(xOfs), 0), w);
+    uint32_t x1 = std::max<int64_t>(std::min<int64_t>(854 - int64_t(xOfs), w), x0);
+    count = x1 - x0;
+    return xOfs;
+}
+
+bool Display::rowDirty(uint32_t address, uint32_t size) {
+    // Check if any RAM page under a row was written since the last frame
+    for (uint32_t i = (address & 0x3FFFFF) >> 12; i <= ((address + size - 1) & 0x3FFFFF) >> 12; i++)
+        if (dirtyPages[i]) return true;
+    return false;
+}
+
+void Display::renderFrame(uint32_t *buffer) {
+    // Capture and convert every row of a frame right away
+    static FrameJob job;
+    captureFrame(job, false);
+    convertFrame(buffer, job);
+}
+
+void Display::captureFrame(FrameJob &job, bool dirtyOnly) {
+    // Take the current parameters and palette
+    job.xOfs = getColumns(job.x0, job.count);
+    job.format = pixelFormat & 0x3;
+    job.clear = !dirtyOnly;
+    job.unchanged = false;
+    memcpy(job.palette, palette, sizeof(palette));
+    memset(job.rowMask, 0, sizeof(job.rowMask));
+    uint32_t h = std::min(fbHeight, 480U);
+
+    // Copy raw rows from memory, limited to ones that were written if the last frame can be reused
+    switch (job.format) {
+    case 0: // 8-bit palette
+        for (uint32_t y = 0; y < h; y++) {
+            // Skip rows that land off screen or didn't change
+            uint32_t fbY = y + fbYOffset - 8;
+            uint32_t address = fbAddress + y * fbStride + job.x0;
+            if (fbY >= 480 || !job.count || (dirtyOnly && !rowDirty(address, job.count))) continue;
+
+            // Copy 8-bit palette indices, directly from RAM if possible
+            uint8_t *dst = job.rows[fbY];
+            if (uint8_t *src = Memory::getRam(address, job.count))
+                memcpy(dst, src, job.count);
+            else for (uint32_t x = 0; x < job.count; x++)
+                dst[x] = Memory::read<uint8_t>(address + x);
+            job.rowMask[fbY] = 1;
         }
         break;
 
     case 2: // 16-bit ARGB
-        for (int y = 0; y < h; y++) {
-            for (int x = 0; x < w; x++) {
-                // Check bounds for the current pixel
-                uint32_t fbY, fbX;
-                if ((fbY = y + fbYOffset - 8) >= 480) break;
-                if ((fbX = x + fbXOffset - 96) >= 854) continue;
-
-                // Convert a 16-bit ARGB color to 32-bit ABGR
-                uint16_t color = Memory::read<uint16_t>(fbAddress + (y * fbStride + x) * 2);
-                uint8_t r = ((color >> 10) & 0x1F) * 0xFF / 0x1F;
-                uint8_t g = ((color >> 5) & 0x1F) * 0xFF / 0x1F;
-                uint8_t b = ((color >> 0) & 0x1F) * 0xFF / 0x1F;
-                buffer[fbY * 854 + fbX] = 0xFF000000 | (b << 16) | (g << 8) | r;
-            }
+        for (uint32_t y = 0; y < h; y++) {
+            // Skip rows that land off screen or didn't change
+            uint32_t fbY = y + fbYOffset - 8;
+            uint32_t address = (fbAddress + (y * fbStride + job.x0) * 2) & ~1;
+            if (fbY >= 480 || !job.count || (dirtyOnly && !rowDirty(address, job.count * 2))) continue;
+
+            // Copy 16-bit ARGB colors, directly from RAM if possible
+            uint16_t *dst = (uint16_t*)job.rows[fbY];
+            if (uint8_t *src = Memory::getRam(address, job.count * 2))
+                memcpy(dst, src, job.count * 2);
+            else for (uint32_t x = 0; x < job.count; x++)
+                dst[x] = Memory::read<uint16_t>(address + x * 2);
+            job.rowMask[fbY] = 1;
         }
         break;
 
     default:
         // Handle unimplemented formats by drawing nothing
-        printf("Unimplemented framebuffer format: %d\n", fmt);
+        printf("Unimplemented framebuffer format: %d\n", job.format);
         break;
     }
+}
+
+void Display::convertFrame(uint32_t *buffer, const FrameJob &job) {
+    // Clear the buffer if the whole frame was captured
+    if (job.clear)
+        memset(buffer, 0, 854 * 480 * 4);
+
+    // Convert each captured row to 32-bit ABGR, leaving the rest of the buffer as it was
+    for (uint32_t y = 0; y < 480; y++) {
+        if (!job.rowMask[y]) continue;
+        uint32_t *dst = &buffer[y * 854 + job.x0 + job.xOfs];
+        if (job.format == 0)
+            (*convertPal)(dst, job.rows[y], job.count, job.palette);
+        else
+            (*convert555)(dst, (const uint16_t*)job.rows[y], job.count);
+    }
+}
+
+void Display::presentJob(const FrameJob &job) {
+    // Queue the unchanged marker if nothing was captured, so the presenter still takes something this V-blank
+    if (job.unchanged) {
+        queueBuffer(&unchangedMarker);
+        return;
+    }
+
+    // Take a buffer and copy in rows that changed since the frame it holds, unless the whole frame is redrawn
+    uint32_t *buffer = takeBuffer();
+    uint32_t &serial = bufferSerials[(buffer - frames[0]) / (854 * 480)];
+    frameSerial++;
+    for (uint32_t y = 0; y < 480 && !job.clear && buffer != lastBuffer; y++)
+        if (rowSerials[y] > serial)
+            memcpy(&buffer[y * 854], &lastBuffer[y * 854], 854 * 4);
+
+    // Convert the captured rows straight into the buffer and queue it to be displayed
+    convertFrame(buffer, job);
+    for (uint32_t y = 0; y < 480; y++)
+        if (job.clear || job.rowMask[y]) rowSerials[y] = frameSerial;
+    serial = frameSerial;
+    lastBuffer = buffer;
+    queueBuffer(buffer);
+}
+
+void Display::startThread() {
+    // Start the render thread if it wasn't running
+    if (renderThread) return;
+    rendering = true;
+    renderThread = new std::thread(renderLoop);
+}
+
+void Display::stopThread() {
+    // Stop the render thread once it finishes the frames it was given
+    if (!renderThread) return;
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        rendering = false;
+    }
+    jobCond.notify_all();
+    renderThread->join();
+    delete renderThread;
+    renderThread = nullptr;
+}
+
+void Display::renderLoop() {
+    while (true) {
+        // Wait for the core to capture a frame, or exit when stopped with nothing left
+        std::unique_lock<std::mutex> lock(jobMutex);
+        jobCond.wait(lock, [] { return jobHead != jobTail || !rendering; });
+        if (jobHead == jobTail) return;
+        lock.unlock();
+
+        // Convert and queue the frame, then free its slot for the core
+        presentJob(jobs[jobTail % JOB_COUNT]);
+        lock.lock();
+        jobTail++;
+        lock.unlock();
+        jobCond.notify_all();
+    }
+}
+
+bool Display::watchFrame() {
+    // Find the range of memory the visible part of the framebuffer is read from
+    uint8_t pages[0x400] = {};
+    uint32_t x0, count, h = std::min(fbHeight, 480U);
+    getColumns(x0, count);
+    uint8_t fmt = pixelFormat & 0x3;
+    if (h && count && (fmt == 0 || fmt == 2)) {
+        uint64_t size = (fmt == 0) ? 1 : 2;
+        uint64_t start = (fbAddress + x0 * size) & ~(size - 1);
+        uint64_t end = start + (uint64_t(h - 1) * fbStride + count) * size;
+
+        // Give up on watching if the range isn't within a single mirror of RAM
+        if (start >= 0x40000000 || end - start > 0x400000 || !Memory::getRam(start, end - start))
+            return false;
+        for (uint32_t i = (start & 0x3FFFFF) >> 12; i <= ((end - 1) & 0x3FFFFF) >> 12; i++)
+            pages[i] = 1;
+    }
 
-    // Queue the buffer to be displayed once there's room
-    mutex.lock();
-    while (buffers.size() > 2) {
-        mutex.unlock();
-        std::this_thread::yield();
-        mutex.lock();
+    // Watch pages that were just written or newly cover the framebuffer, and stop watching ones that don't
+    for (uint32_t i = 0; i < 0x400; i++) {
+        if (pages[i] && (!framePages[i] || dirtyPages[i]))
+            Memory::protectPage(i << 12, WATCH_FRAME, true);
+        else if (!pages[i] && framePages[i] && !dirtyPages[i])
+            Memory::protectPage(i << 12, WATCH_FRAME, false);
     }
-    buffers.push(buffer);
-    mutex.unlock();
+
+    // Start tracking changes for the next frame
+    memcpy(framePages, pages, sizeof(framePages));
+    memset(dirtyPages, 0, sizeof(dirtyPages));
+    anyDirty = false;
+    return true;
+}
+
+void Display::markDirty(uint32_t address) {
+    // Mark a framebuffer page as written, and let further writes through until the next frame
+    dirtyPages[(address & 0x3FFFFF) >> 12] = 1;
+    anyDirty = true;
+    Memory::protectPage(address, WATCH_FRAME, false);
+}
+
+void Display::drawFrame() {
+    // Capture the whole frame if its parameters changed, or only the rows under written pages
+    // If nothing changed, nothing is captured, and the marker queued in its place keeps the last frame up
+    bool unchanged = !redraw && !anyDirty;
+    if (renderThread) {
+        // Wait for a free slot, then hand the frame to the render thread
+        std::unique_lock<std::mutex> lock(jobMutex);
+        jobCond.wait(lock, [] { return jobHead - jobTail < JOB_COUNT; });
+        lock.unlock();
+        FrameJob &job = jobs[jobHead % JOB_COUNT];
+        if (unchanged)
+            job.unchanged = true;
+        else
+            captureFrame(job, !redraw);
+        lock.lock();
+        jobHead++;
+        lock.unlock();
+        jobCond.notify_all();
+    }
+    else {
+        // Convert the frame on the core thread if there's no render thread
+        if (unchanged)
+            jobs[0].unchanged = true;
+        else
+            captureFrame(jobs[0], !redraw);
+        presentJob(jobs[0]);
+    }
+
+    // Watch the framebuffer for writes, or redraw it every frame if it can't be watched
+    redraw = !watchFrame();
 
     // Trigger a V-blank interrupt and schedule the next one
     Interrupts::requestIrq(22);
-    Core::schedule(drawFrame, 108000000 / 60);
+    Core::schedule(frameEvent, drawFrame, 108000000 / 60);
+}
+
+void Display::writeReg(uint32_t &reg, uint32_t mask, uint32_t value) {
+    // Write to a register that affects rendering, redrawing the whole frame if it changes
+    uint32_t old = reg;
+    reg = (reg & ~mask) | (value & mask);
+    if (reg != old) redraw = true;
 }
 
 uint32_t Display::readFbXOfs() {
@@ -163,37 +534,37 @@ uint32_t Display::readFbAddr() {
 
 void Display::writeFbXOfs(uint32_t mask, uint32_t value) {
     // Write to the framebuffer X-offset register
-    fbXOffset = (fbXOffset & ~mask) | (value & mask);
+    writeReg(fbXOffset, mask, value);
 }
 
 void Display::writeFbWidth(uint32_t mask, uint32_t value) {
     // Write to the framebuffer width register
-    fbWidth = (fbWidth & ~mask) | (value & mask);
+    writeReg(fbWidth, mask, value);
 }
 
 void Display::writeFbYOfs(uint32_t mask, uint32_t value) {
     // Write to the framebuffer Y-offset register
-    fbYOffset = (fbYOffset & ~mask) | (value & mask);
+    writeReg(fbYOffset, mask, value);
 }
 
 void Display::writeFbHeight(uint32_t mask, uint32_t value) {
     // Write to the framebuffer height register
-    fbHeight = (fbHeight & ~mask) | (value & mask);
+    writeReg(fbHeight, mask, value);
 }
 
 void Display::writeFbStride(uint32_t mask, uint32_t value) {
     // Write to the framebuffer stride register
-    fbStride = (fbStride & ~mask) | (value & mask);
+    writeReg(fbStride, mask, value);
 }
 
 void Display::writeFbAddr(uint32_t mask, uint32_t value) {
     // Write to the framebuffer address register
-    fbAddress = (fbAddress & ~mask) | (value & mask);
+    writeReg(fbAddress, mask, value);
 }
 
 void Display::writePixelFmt(uint32_t mask, uint32_t value) {
     // Write to the pixel format register
-    pixelFormat = (pixelFormat & ~mask) | (value & mask);
+    writeReg(pixelFormat, mask, value);
 }
 
 void Display::writePalAddr(uint32_t mask, uint32_t value) {
@@ -206,5 +577,9 @@ void Display::writePalData(uint32_t mask, uint32_t value) {
     uint8_t r = (value & mask) >> 16;
     uint8_t g = (value & mask) >> 8;
     uint8_t b = (value & mask) >> 0;
-    palette[palAddress++] = 0xFF000000 | (b << 16) | (g << 8) | r;
+    uint32_t color = 0xFF000000 | (b << 16) | (g << 8) | r;
+
+    // Redraw the whole frame if the palette changed
+    if (palette[palAddress] != color) redraw = true;
+    palette[palAddress++] = color;
 }
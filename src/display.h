@@ -21,9 +21,41 @@
 
 #include <cstdint>
 
+struct State;
+
+// Levels of pixel conversion kernels, which use lower levels where they have none
+enum ConvertLevel {
+    CONVERT_SCALAR,
+    CONVERT_SSE2,
+    CONVERT_AVX2
+};
+
+// What the core does with a new frame when the display queue is full
+enum FramePolicy {
+    FRAME_BLOCK, // Wait for the presenter to take a frame
+    FRAME_DROP, // Drop the oldest queued frame
+    FRAME_OVERWRITE // Skip the new frame, drawing over it next time
+};
+
 namespace Display {
+    extern void (*convertPal)(uint32_t *dst, const uint8_t *src, uint32_t count, const uint32_t *palette);
+    extern void (*convert555)(uint32_t *dst, const uint16_t *src, uint32_t count);
+
+    void initConvert();
+    bool setConvertLevel(ConvertLevel level);
+    void renderFrame(uint32_t *buffer);
+    void drawFrame();
+    void markDirty(uint32_t address);
+
     void reset();
+    void syncState(State &state);
+    void startThread();
+    void stopThread();
+    void setFramePolicy(FramePolicy policy);
+    void setFrameCallback(void (*callback)());
+    bool isUnchanged(const uint32_t *buffer);
     uint32_t *getBuffer();
+    void releaseBuffer(uint32_t *buffer);
 
     uint32_t readFbXOfs();
     uint32_t readFbWidth();
@@ -0,0 +1,141 @@
+/*
+    Copyright 2024 Hydr8gon
+
+    This file is part of GamePawd.
+
+    GamePawd is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GamePawd is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "display.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86
+#endif
+
+namespace Display {
+    void (*convertPal)(uint32_t*, const uint8_t*, uint32_t, const uint32_t*);
+    void (*convert555)(uint32_t*, const uint16_t*, uint32_t);
+
+    void convertPalScalar(uint32_t *dst, const uint8_t *src, uint32_t count, const uint32_t *palette);
+    void convert555Scalar(uint32_t *dst, const uint16_t *src, uint32_t count);
+
+#ifdef CONVERT_X86
+    __attribute__((target("sse2"))) void convert555Sse2(uint32_t *dst, const uint16_t *src, uint32_t count);
+    __attribute__((target("avx2"))) void convertPalAvx2(uint32_t *dst, const uint8_t *src, uint32_t count, const uint32_t *palette);
+    __attribute__((target("avx2"))) void convert555Avx2(uint32_t *dst, const uint16_t *src, uint32_t count);
+#endif
+}
+
+bool Display::setConvertLevel(ConvertLevel level) {
+    // Check if the host supports a level of conversion kernels
+#ifdef CONVERT_X86
+    __builtin_cpu_init();
+    if ((level >= CONVERT_SSE2 && !__builtin_cpu_supports("sse2")) ||
+        (level >= CONVERT_AVX2 && !__builtin_cpu_supports("avx2")))
+        return false;
+#else
+    if (level > CONVERT_SCALAR) return false;
+#endif
+
+    // Use the kernels for the level, falling back to lower ones where there are none
+    // SSE2 has no gather, so palette lookups only get a vector kernel with AVX2
+    convertPal = convertPalScalar;
+    convert555 = convert555Scalar;
+#ifdef CONVERT_X86
+    if (level >= CONVERT_SSE2)
+        convert555 = convert555Sse2;
+    if (level >= CONVERT_AVX2) {
+        convertPal = convertPalAvx2;
+        convert555 = convert555Avx2;
+    }
+#endif
+    return true;
+}
+
+void Display::initConvert() {
+    // Use the best conversion kernels the host supports
+    if (!setConvertLevel(CONVERT_AVX2) && !setConvertLevel(CONVERT_SSE2))
+        setConvertLevel(CONVERT_SCALAR);
+}
+
+void Display::convertPalScalar(uint32_t *dst, const uint8_t *src, uint32_t count, const uint32_t *palette) {
+    // Look up colors with 8-bit palette indices
+    for (uint32_t i = 0; i < count; i++)
+        dst[i] = palette[src[i]];
+}
+
+void Display::convert555Scalar(uint32_t *dst, const uint16_t *src, uint32_t count) {
+    // Convert 16-bit ARGB colors to 32-bit ABGR
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t r = ((src[i] >> 10) & 0x1F) * 0xFF / 0x1F;
+        uint8_t g = ((src[i] >> 5) & 0x1F) * 0xFF / 0x1F;
+        uint8_t b = ((src[i] >> 0) & 0x1F) * 0xFF / 0x1F;
+        dst[i] = 0xFF000000 | (b << 16) | (g << 8) | r;
+    }
+}
+
+#ifdef CONVERT_X86
+
+void Display::convert555Sse2(uint32_t *dst, const uint16_t *src, uint32_t count) {
+    // Convert 8 colors at a time, using (x * 1053) >> 7 to match x * 0xFF / 0x1F exactly
+    const __m128i mask = _mm_set1_epi16(0x1F), mul = _mm_set1_epi16(1053), alpha = _mm_set1_epi16(0xFF00);
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i c = _mm_loadu_si128((const __m128i*)&src[i]);
+        __m128i r = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(c, 10), mask), mul), 7);
+        __m128i g = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(c, 5), mask), mul), 7);
+        __m128i b = _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(c, mask), mul), 7);
+
+        // Interleave red and green with blue and alpha to form 32-bit ABGR
+        __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+        __m128i ba = _mm_or_si128(b, alpha);
+        _mm_storeu_si128((__m128i*)&dst[i + 0], _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i*)&dst[i + 4], _mm_unpackhi_epi16(rg, ba));
+    }
+    convert555Scalar(&dst[i], &src[i], count - i);
+}
+
+void Display::convertPalAvx2(uint32_t *dst, const uint8_t *src, uint32_t count, const uint32_t *palette) {
+    // Gather 8 palette colors at a time
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&src[i]));
+        __m256i color = _mm256_i32gather_epi32((const int*)palette, index, 4);
+        _mm256_storeu_si256((__m256i*)&dst[i], color);
+    }
+    convertPalScalar(&dst[i], &src[i], count - i, palette);
+}
+
+void Display::convert555Avx2(uint32_t *dst, const uint16_t *src, uint32_t count) {
+    // Convert 16 colors at a time, using (x * 1053) >> 7 to match x * 0xFF / 0x1F exactly
+    const __m256i mask = _mm256_set1_epi16(0x1F), mul = _mm256_set1_epi16(1053), alpha = _mm256_set1_epi16(0xFF00);
+    uint32_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)&src[i]);
+        __m256i r = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(c, 10), mask), mul), 7);
+        __m256i g = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(c, 5), mask), mul), 7);
+        __m256i b = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_and_si256(c, mask), mul), 7);
+
+        // Interleave within 128-bit lanes, then swap the middle halves back into pixel order
+        __m256i rg = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+        __m256i ba = _mm256_or_si256(b, alpha);
+        __m256i lo = _mm256_unpacklo_epi16(rg, ba), hi = _mm256_unpackhi_epi16(rg, ba);
+        _mm256_storeu_si256((__m256i*)&dst[i + 0], _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*)&dst[i + 8], _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    convert555Scalar(&dst[i], &src[i], count - i);
+}
+
+#endif
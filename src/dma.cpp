@@ -23,6 +23,7 @@
 #include "interrupts.h"
 #include "memory.h"
 #include "spi.h"
+#include "state.h"
 
 namespace Dma {
     uint32_t controls[3];
@@ -50,6 +51,43 @@ void Dma::reset() {
     memset(simpleFills, 0, sizeof(simpleFills));
     spiCount = 0;
     spiAddress = 0;
+
+    // Register the SPI DMA I/O registers
+    Memory::registerRead(0xF0004050, 4, IO_READ(readSpiCount));
+    Memory::registerWrite(0xF0004040, 4, IO_WRITE(writeSpiEnable));
+    Memory::registerWrite(0xF0004044, 4, IO_WRITE(writeSpiControl));
+    Memory::registerWrite(0xF0004050, 4, IO_WRITE(writeSpiCount));
+    Memory::registerWrite(0xF0004054, 4, IO_WRITE(writeSpiAddress));
+
+    // Register the I/O registers for each general DMA channel
+    for (int i = 0; i < 3; i++) {
+        uint32_t base = 0xF0004100 + i * 0x40;
+        Memory::registerRead(base + 0x14, 4, readCount, i);
+        Memory::registerWrite(base + 0x00, 4, writeEnable, i);
+        Memory::registerWrite(base + 0x04, 4, writeControl, i);
+        Memory::registerWrite(base + 0x08, 4, writeChunkSize, i);
+        Memory::registerWrite(base + 0x0C, 4, writeSrcStride, i);
+        Memory::registerWrite(base + 0x10, 4, writeDstStride, i);
+        Memory::registerWrite(base + 0x14, 4, writeCount, i);
+        Memory::registerWrite(base + 0x18, 4, writeSrcAddr, i);
+        Memory::registerWrite(base + 0x1C, 4, writeDstAddr, i);
+        Memory::registerWrite(base + 0x20, 4, writeSimpFill, i);
+    }
+}
+
+void Dma::syncState(State &state) {
+    // Save or load the registers
+    state.sync(controls);
+    state.sync(chunkSizes);
+    state.sync(srcStrides);
+    state.sync(dstStrides);
+    state.sync(counts);
+    state.sync(srcAddrs);
+    state.sync(dstAddrs);
+    state.sync(simpleFills);
+    state.sync(spiControl);
+    state.sync(spiCount);
+    state.sync(spiAddress);
 }
 
 uint32_t Dma::readSpiCount() {
@@ -21,8 +21,11 @@
 
 #include <cstdint>
 
+struct State;
+
 namespace Dma {
     void reset();
+    void syncState(State &state);
 
     uint32_t readSpiCount();
     uint32_t readCount(int i);
@@ -0,0 +1,172 @@
+/*
+    Copyright 2024 Hydr8gon
+
+    This file is part of GamePawd.
+
+    GamePawd is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GamePawd is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../core.h"
+#include "../arm9.h"
+#include "../display.h"
+#include "../input.h"
+#include "../rewind.h"
+
+// Cycles between V-blanks at 108 MHz and 60 Hz
+#define FRAME_CYCLES (108000000 / 60)
+
+// How long boot runs before its state gets cached
+#define BOOT_CYCLES (FRAME_CYCLES * 300)
+
+// How much memory rewind history can take
+#define REWIND_BYTES (64 << 20)
+
+namespace Headless {
+    uint64_t frameLimit = 600;
+    uint64_t cycleLimit = 0;
+    const char *dumpPath = nullptr;
+    bool rewind = false;
+    uint64_t framesWritten = 0;
+
+    bool parseArgs(int argc, char **argv);
+    void writeFrame(uint32_t *buffer, uint64_t frame);
+    void collectFrames(uint64_t frame);
+}
+
+bool Headless::parseArgs(int argc, char **argv) {
+    // Read options for how long to run and where to write frames
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            frameLimit = strtoull(argv[++i], nullptr, 0);
+            cycleLimit = 0;
+        }
+        else if (!strcmp(argv[i], "--cycles") && i + 1 < argc) {
+            cycleLimit = strtoull(argv[++i], nullptr, 0);
+            frameLimit = 0;
+        }
+        else if (!strcmp(argv[i], "--dump") && i + 1 < argc) {
+            dumpPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--boot-cache") && i + 1 < argc) {
+            Core::setBootCache(argv[++i], BOOT_CYCLES);
+        }
+        else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+            if (!Input::setReplay(argv[++i]))
+                return false;
+        }
+        else if (!strcmp(argv[i], "--no-idle-skip")) {
+            Arm9::setIdleSkip(false);
+        }
+        else if (!strcmp(argv[i], "--jit")) {
+            Arm9::setJit(true);
+        }
+        else if (!strcmp(argv[i], "--rewind") && i + 1 < argc) {
+            Rewind::setLimits(strtoul(argv[++i], nullptr, 0), REWIND_BYTES);
+            rewind = true;
+        }
+        else {
+            printf("Usage: %s [--frames count | --cycles count] [--dump directory] [--boot-cache directory] [--rewind frames]\n"
+                "    [--replay file] [--no-idle-skip] [--jit]\n", argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+void Headless::writeFrame(uint32_t *buffer, uint64_t frame) {
+    // Write a frame to the dump directory as a binary PPM image
+    char name[1024];
+    snprintf(name, sizeof(name), "%s/frame%06llu.ppm", dumpPath, (unsigned long long)frame);
+    FILE *file = fopen(name, "wb");
+    if (!file) {
+        printf("Failed to write frame to %s\n", name);
+        return;
+    }
+
+    // Convert each pixel from 32-bit ABGR to 24-bit RGB
+    static uint8_t data[854 * 480 * 3];
+    for (uint32_t i = 0; i < 854 * 480; i++) {
+        data[i * 3 + 0] = buffer[i] >> 0;
+        data[i * 3 + 1] = buffer[i] >> 8;
+        data[i * 3 + 2] = buffer[i] >> 16;
+    }
+    fprintf(file, "P6\n854 480\n255\n");
+    fwrite(data, sizeof(uint8_t), sizeof(data), file);
+    fclose(file);
+    framesWritten++;
+}
+
+void Headless::collectFrames(uint64_t frame) {
+    // Take every queued frame so the queue never fills, keeping a copy of the newest one that changed
+    static uint32_t last[854 * 480];
+    bool queued = false;
+    while (uint32_t *buffer = Display::getBuffer()) {
+        if (!Display::isUnchanged(buffer))
+            memcpy(last, buffer, sizeof(last));
+        Display::releaseBuffer(buffer);
+        queued = true;
+    }
+
+    // Write out the current frame if requested, which is the last one that changed
+    if (queued && dumpPath)
+        writeFrame(last, frame);
+}
+
+int main(int argc, char **argv) {
+    // Boot the firmware without a frontend, using the block cache for batch runs unless the JIT is asked for
+    Arm9::setBlockCache(true);
+    if (!Headless::parseArgs(argc, argv))
+        return 1;
+    if (Headless::rewind)
+        Rewind::startThread();
+    Core::reset();
+
+    // Run the emulator as fast as possible for a frame's worth of cycles at a time
+    // Frames are converted on this thread and collected after each run, so none are skipped
+    // Only count cycles run here, since a cached boot state starts later
+    uint64_t total = Headless::cycleLimit ? Headless::cycleLimit : Headless::frameLimit * FRAME_CYCLES;
+    uint64_t startCycles = Core::globalCycles;
+    uint64_t startIdle = Arm9::idleCycles;
+    uint64_t startCoalesced = Core::coalescedEvents;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t cycles = 0, frame = 0; cycles < total; frame++) {
+        uint32_t step = std::min<uint64_t>(total - cycles, FRAME_CYCLES);
+        Core::runFor(step);
+        cycles += step;
+        Headless::collectFrames(frame);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Report how fast the emulator ran
+    uint64_t cycles = Core::globalCycles - startCycles;
+    double frames = double(cycles) / FRAME_CYCLES;
+    printf("Wall time: %.3f s\n", seconds);
+    printf("Cycles: %llu (%.0f cycles/s)\n", (unsigned long long)cycles, cycles / seconds);
+    printf("Frames: %.0f (%.2f frames/s, %.1f%% speed)\n", frames, frames / seconds, frames / seconds * 100 / 60);
+    printf("Idle loops: %.1f%% of cycles skipped\n", cycles ? (Arm9::idleCycles - startIdle) * 100.0 / cycles : 0.0);
+    printf("Scheduler: %llu events coalesced\n", (unsigned long long)(Core::coalescedEvents - startCoalesced));
+    if (Headless::dumpPath)
+        printf("Frames written: %llu\n", (unsigned long long)Headless::framesWritten);
+    if (Headless::rewind) {
+        Rewind::stopThread();
+        Rewind::printStats();
+    }
+    return 0;
+}
@@ -22,6 +22,8 @@
 
 #include "i2c.h"
 #include "interrupts.h"
+#include "memory.h"
+#include "state.h"
 
 namespace I2c {
     uint32_t controls[4];
@@ -47,6 +49,34 @@ void I2c::reset() {
     dataCount = 0;
     deviceId = 0;
     command = 0;
+
+    // Register the shared I2C I/O registers
+    Memory::registerRead(0xF0005800, 4, IO_READ(readIrqFlags));
+    Memory::registerRead(0xF0005804, 4, IO_READ(readIrqEnable));
+    Memory::registerWrite(0xF0005804, 4, IO_WRITE(writeIrqEnable));
+    Memory::registerWrite(0xF0005808, 4, IO_WRITE(writeIrqAck));
+
+    // Register the I/O registers for each I2C bus
+    for (int i = 0; i < 4; i++) {
+        uint32_t base = 0xF0005C00 + i * 0x400;
+        Memory::registerRead(base + 0x00, 4, [](int) -> uint32_t { return 0x1; }); // Stub
+        Memory::registerRead(base + 0x04, 4, readData, i, false);
+        Memory::registerRead(base + 0x08, 4, readControl, i);
+        Memory::registerRead(base + 0x18, 4, readStatus, i);
+        Memory::registerWrite(base + 0x04, 4, writeData, i);
+        Memory::registerWrite(base + 0x08, 4, writeControl, i);
+    }
+}
+
+void I2c::syncState(State &state) {
+    // Save or load the registers and transfer state
+    state.sync(controls);
+    state.sync(statuses);
+    state.sync(irqEnable);
+    state.sync(irqFlags);
+    state.sync(dataCount);
+    state.sync(deviceId);
+    state.sync(command);
 }
 
 void I2c::updateTransfer(int i) {
@@ -21,8 +21,11 @@
 
 #include <cstdint>
 
+struct State;
+
 namespace I2c {
     void reset();
+    void syncState(State &state);
 
     uint32_t readIrqFlags();
     uint32_t readIrqEnable();
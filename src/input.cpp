@@ -0,0 +1,153 @@
+/*
+    Copyright 2024 Hydr8gon
+
+    This file is part of GamePawd.
+
+    GamePawd is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GamePawd is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "input.h"
+#include "core.h"
+#include "spi.h"
+
+// Bump whenever the layout of input logs changes, so old files are rejected
+#define INPUT_VERSION 1
+
+// The button state from a point in time onward
+struct InputEntry {
+    uint64_t cycles;
+    uint32_t buttons;
+
+    bool operator<(const InputEntry &entry) const { return cycles < entry.cycles; }
+};
+
+namespace Input {
+    // Buttons as the frontend last set them, which the emulation thread picks up
+    std::atomic<uint16_t> liveButtons;
+
+    // The log being recorded or replayed, with live input ignored while replaying
+    std::vector<InputEntry> log;
+    std::string recordPath;
+    uint64_t replayHash;
+    bool replaying;
+}
+
+void Input::reset() {
+    // Start a new recording, keeping a replayed log as it is
+    if (!replaying)
+        log.clear();
+    else if (replayHash != Spi::firmwareHash())
+        printf("Input log was recorded with different firmware, so replay may diverge\n");
+}
+
+void Input::pressKey(int key) {
+    // Set a button bit to press it, which is safe to call from any thread
+    liveButtons |= (1 << key);
+}
+
+void Input::releaseKey(int key) {
+    // Clear a button bit to release it, which is safe to call from any thread
+    liveButtons &= ~(1 << key);
+}
+
+void Input::update() {
+    // Bring the buttons up to date at the exact cycle the firmware scans them, which is the only time they're seen
+    // When replaying, apply the last logged state from this cycle or earlier, so every entry lands on its own stamp
+    // Entries are looked up by cycle, so loading a state or stepping back keeps the replay in step
+    if (replaying) {
+        InputEntry now = { Core::globalCycles, 0 };
+        auto entry = std::upper_bound(log.begin(), log.end(), now);
+        Spi::setButtons((entry != log.begin()) ? (entry - 1)->buttons : 0);
+        return;
+    }
+
+    // Otherwise apply changes to the live buttons, logging them when recording
+    // Entries from after the current cycle are dropped, since they were undone by loading a state or stepping back
+    uint16_t buttons = liveButtons;
+    if (buttons == Spi::getButtons()) return;
+    Spi::setButtons(buttons);
+    if (recordPath.empty()) return;
+    while (!log.empty() && log.back().cycles >= Core::globalCycles)
+        log.pop_back();
+    log.push_back({ Core::globalCycles, buttons });
+}
+
+void Input::setRecord(const char *path) {
+    // Set a file to record input to when the log is written, or stop recording with null, taking effect on reset
+    recordPath = path ? path : "";
+    replaying = false;
+}
+
+bool Input::setReplay(const char *path) {
+    // Stop replaying if there's no file, taking effect on reset
+    recordPath.clear();
+    replaying = false;
+    log.clear();
+    if (!path) return true;
+
+    // Read the header, rejecting files that aren't input logs or were made by a different version
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("Failed to open input log: %s\n", path);
+        return false;
+    }
+    uint32_t header[2];
+    uint64_t hash, count;
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != 0x52495047 || header[1] != INPUT_VERSION ||
+            fread(&hash, sizeof(hash), 1, file) != 1 || fread(&count, sizeof(count), 1, file) != 1) {
+        printf("Not a supported input log: %s\n", path);
+        fclose(file);
+        return false;
+    }
+
+    // Read the entries, which only match the original run with the same firmware
+    replayHash = hash;
+    log.resize(count);
+    for (uint64_t i = 0; i < count; i++) {
+        if (fread(&log[i].cycles, sizeof(uint64_t), 1, file) != 1 || fread(&log[i].buttons, sizeof(uint32_t), 1, file) != 1) {
+            printf("Truncated input log: %s\n", path);
+            log.clear();
+            fclose(file);
+            return false;
+        }
+    }
+    fclose(file);
+    replaying = true;
+    return true;
+}
+
+bool Input::writeLog() {
+    // Write the recorded log with a header of a magic string, the version, the firmware hash, and the entry count
+    if (recordPath.empty()) return false;
+    FILE *file = fopen(recordPath.c_str(), "wb");
+    if (!file) {
+        printf("Failed to open input log for writing: %s\n", recordPath.c_str());
+        return false;
+    }
+    uint32_t header[] = { 0x52495047, INPUT_VERSION }; // "GPIR"
+    uint64_t hash = Spi::firmwareHash(), count = log.size();
+    bool done = fwrite(header, sizeof(header), 1, file) == 1 &&
+        fwrite(&hash, sizeof(hash), 1, file) == 1 && fwrite(&count, sizeof(count), 1, file) == 1;
+    for (uint64_t i = 0; i < count && done; i++)
+        done = fwrite(&log[i].cycles, sizeof(uint64_t), 1, file) == 1 && fwrite(&log[i].buttons, sizeof(uint32_t), 1, file) == 1;
+    fclose(file);
+    if (!done) printf("Failed to write input log: %s\n", recordPath.c_str());
+    return done;
+}
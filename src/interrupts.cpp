@@ -23,6 +23,8 @@
 #include "interrupts.h"
 #include "arm9.h"
 #include "core.h"
+#include "memory.h"
+#include "state.h"
 
 namespace Interrupts {
     uint32_t irqEnables[32];
@@ -30,6 +32,7 @@ namespace Interrupts {
     uint32_t enableMask;
     uint32_t priorityMask;
     uint32_t irqIndex;
+    int checkEvent = -1;
 }
 
 void Interrupts::reset() {
@@ -39,6 +42,30 @@ void Interrupts::reset() {
     enableMask = 0;
     priorityMask = 0;
     irqIndex = 0;
+
+    // Register the interrupt I/O registers, with priority registers mirrored in two places
+    for (int i = 0; i < 32; i++) {
+        Memory::registerRead(0xF0001208 + i * 4, 4, readIrqEnable, i);
+        Memory::registerWrite(0xF0001208 + i * 4, 4, writeIrqEnable, i);
+    }
+    Memory::registerRead(0xF00013F0, 4, IO_READ(readIrqIndex));
+    for (uint32_t base = 0xF00013F8; base <= 0xF00019F8; base += 0x600) {
+        Memory::registerRead(base + 0x0, 4, IO_READ(readPrioMask));
+        Memory::registerRead(base + 0x4, 4, IO_READ(readPrioClear), 0, false);
+        Memory::registerWrite(base + 0x0, 4, IO_WRITE(writePrioMask));
+    }
+
+    // Register the interrupt check, which is always scheduled as a unique task
+    Core::registerTask(checkIrqs, &checkEvent);
+}
+
+void Interrupts::syncState(State &state) {
+    // Save or load the registers
+    state.sync(irqEnables);
+    state.sync(requestFlags);
+    state.sync(enableMask);
+    state.sync(priorityMask);
+    state.sync(irqIndex);
 }
 
 void Interrupts::checkIrqs() {
@@ -59,7 +86,7 @@ void Interrupts::checkIrqs() {
 void Interrupts::requestIrq(int i) {
     // Request an interrupt and check if one should trigger
     requestFlags |= (1 << i);
-    Core::schedule(checkIrqs, 1);
+    Core::scheduleUnique(checkEvent, checkIrqs, 1);
 }
 
 uint32_t Interrupts::readIrqEnable(int i) {
@@ -90,7 +117,7 @@ void Interrupts::writeIrqEnable(int i, uint32_t mask, uint32_t value) {
 
     // Track enabled interrupts and check if one should trigger
     enableMask = (enableMask & ~(1 << i)) | (!(irqEnables[i] & 0x40) << i);
-    Core::schedule(checkIrqs, 1);
+    Core::scheduleUnique(checkEvent, checkIrqs, 1);
 }
 
 void Interrupts::writePrioMask(uint32_t mask, uint32_t value) {
@@ -100,5 +127,5 @@ void Interrupts::writePrioMask(uint32_t mask, uint32_t value) {
 
     // Acknowledge the most recent interrupt and check if one should trigger
     requestFlags &= ~(1 << irqIndex);
-    Core::schedule(checkIrqs, 1);
+    Core::scheduleUnique(checkEvent, checkIrqs, 1);
 }
@@ -21,8 +21,13 @@
 
 #include <cstdint>
 
+struct State;
+
 namespace Interrupts {
+    extern int checkEvent;
+
     void reset();
+    void syncState(State &state);
     void checkIrqs();
     void requestIrq(int i);
 
@@ -20,60 +20,190 @@
 #include <cstdio>
 #include <cstring>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #include "memory.h"
+#include "arm9.h"
 #include "display.h"
-#include "dma.h"
-#include "i2c.h"
-#include "interrupts.h"
-#include "spi.h"
-#include "timers.h"
-#include "wifi.h"
-
-// Defines a 16-bit register in an I/O switch statement
-#define DEF_IO16(addr, func) \
-case addr + 0: case addr + 1: \
-    base -= addr; \
-    size = 2; \
-    func; \
-    break;
-
-// Defines a 32-bit register in an I/O switch statement
-#define DEF_IO32(addr, func) \
-case addr + 0: case addr + 1: \
-case addr + 2: case addr + 3: \
-    base -= addr; \
-    size = 4; \
-    func; \
-    break;
-
-// Defines shared parameters for I/O register writes
-#define IOWR_PARAMS mask << (base * 8), data << (base * 8)
+#include "rewind.h"
 
 namespace Memory {
-    uint8_t ram[0x400000]; // 4MB RAM
-    uint32_t counter;
+    struct IoReg {
+        uint32_t address;
+        uint8_t size;
+        int index;
+        bool stable;
+        IoRead read;
+        IoWrite write;
+    };
+
+    uint8_t ramBuffer[0x400000]; // 4MB RAM
+    uint8_t *ram = ramBuffer;
+    uint8_t *fastRead;
+    uint8_t *fastWrite;
+    uint8_t *readMap[0x100000];
+    uint8_t *writeMap[0x100000];
+    uint8_t pageWatches[0x400];
+    bool volatileRead;
+    IoReg *ioReads[0x20000];
+    IoReg *ioWrites[0x20000];
 
+    IoReg *getIoSlot(IoReg **table, uint32_t address);
+    IoReg *findIo(IoReg **table, uint32_t address);
     template <typename T> T ioRead(uint32_t address);
     template <typename T> void ioWrite(uint32_t address, T value);
 }
 
+bool Memory::initFastmem() {
+    // Only try to set up fastmem once, falling back to the static RAM buffer if it fails
+    static bool tried = false;
+    if (tried) return fastRead;
+    tried = true;
+
+#ifdef __linux__
+    // Back RAM with a shared memory file so it can be mapped in several places at once
+    int fd = memfd_create("gamepawd-ram", 0);
+    if (fd < 0 || ftruncate(fd, 0x400000) < 0) {
+        if (fd >= 0) close(fd);
+        printf("Failed to create shared memory for fastmem\n");
+        return false;
+    }
+
+    // Reserve two 4GB regions for loads and stores, leaving everything inaccessible for now
+    void *view = mmap(nullptr, 0x400000, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void *regions = mmap(nullptr, 0x200000000ULL, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (view == MAP_FAILED || regions == MAP_FAILED) {
+        if (view != MAP_FAILED) munmap(view, 0x400000);
+        if (regions != MAP_FAILED) munmap(regions, 0x200000000ULL);
+        close(fd);
+        printf("Failed to reserve address space for fastmem\n");
+        return false;
+    }
+
+    // Map RAM and its mirrors for loads, but only map the base for stores
+    // Stores to mirrors fault like I/O does, so code pages only need to be protected in one place
+    uint8_t *read = (uint8_t*)regions;
+    uint8_t *write = read + 0x100000000ULL;
+    bool mapped = (mmap(write, 0x400000, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED);
+    for (uint32_t i = 0; mapped && i < 0x40000000; i += 0x400000)
+        mapped = (mmap(read + i, 0x400000, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED);
+    close(fd);
+    if (!mapped) {
+        munmap(view, 0x400000);
+        munmap(regions, 0x200000000ULL);
+        printf("Failed to map RAM for fastmem\n");
+        return false;
+    }
+
+    // Use the plain view of the shared memory as RAM from now on
+    ram = (uint8_t*)view;
+    fastRead = read;
+    fastWrite = write;
+    return true;
+#else
+    return false;
+#endif
+}
+
 void Memory::reset()
 {
-    // Reset the memory array
-    memset(ram, 0, sizeof(ram));
-    counter = 0;
+    // Reset the memory array, moving it to shared memory for fastmem first if possible
+    initFastmem();
+    memset(ram, 0, 0x400000);
+
+    // Map every 4KB page of RAM and its mirrors for direct access, leaving the rest to the slow path
+    memset(readMap, 0, sizeof(readMap));
+    memset(writeMap, 0, sizeof(writeMap));
+    for (uint32_t i = 0; i < 0x40000; i++)
+        readMap[i] = writeMap[i] = &ram[(i << 12) & 0x3FFFFF];
+
+    // Stop watching every page, including for fastmem stores
+    memset(pageWatches, 0, sizeof(pageWatches));
+#ifdef __linux__
+    if (fastWrite)
+        mprotect(fastWrite, 0x400000, PROT_READ | PROT_WRITE);
+#endif
+
+    // Register I/O that doesn't belong to any device
+    registerRead(0xF0000000, 4, [](int) -> uint32_t { return 0x00041040; }); // Hardware ID
+}
+
+Memory::IoReg *Memory::getIoSlot(IoReg **table, uint32_t address) {
+    // Get the table slot for an I/O halfword, allocating its 4KB page of slots if needed
+    IoReg *&page = table[(address >> 12) & 0x1FFFF];
+    if (!page) page = new IoReg[0x800]();
+    return &page[(address & 0xFFF) >> 1];
+}
+
+Memory::IoReg *Memory::findIo(IoReg **table, uint32_t address) {
+    // Look up the register covering an I/O byte, or return null if there isn't one
+    IoReg *page = table[(address >> 12) & 0x1FFFF];
+    if (!page || !page[(address & 0xFFF) >> 1].size) return nullptr;
+    return &page[(address & 0xFFF) >> 1];
+}
+
+void Memory::registerRead(uint32_t address, uint8_t size, IoRead read, int index, bool stable) {
+    // Point every halfword of an I/O register at its read callback
+    // Registers aren't stable if reading them has side effects, or their value changes without a write or scheduled task
+    for (uint32_t i = 0; i < size; i += 2) {
+        IoReg *slot = getIoSlot(ioReads, address + i);
+        slot->address = address;
+        slot->size = size;
+        slot->index = index;
+        slot->stable = stable;
+        slot->read = read;
+    }
+}
+
+void Memory::registerWrite(uint32_t address, uint8_t size, IoWrite write, int index) {
+    // Point every halfword of an I/O register at its write callback
+    for (uint32_t i = 0; i < size; i += 2) {
+        IoReg *slot = getIoSlot(ioWrites, address + i);
+        slot->address = address;
+        slot->size = size;
+        slot->index = index;
+        slot->write = write;
+    }
+}
+
+void Memory::protectPage(uint32_t address, PageWatch watch, bool protect) {
+    // Add or remove a reason to watch a RAM page, only remapping it when the first is added or the last removed
+    uint32_t page = (address & 0x3FFFFF) >> 12;
+    uint8_t watches = protect ? (pageWatches[page] | watch) : (pageWatches[page] & ~watch);
+    bool changed = (!watches != !pageWatches[page]);
+    pageWatches[page] = watches;
+    if (!changed) return;
+
+    // Send writes to the page and all of its mirrors through the slow path, or map them directly again
+    for (uint32_t i = page; i < 0x40000; i += 0x400)
+        writeMap[i] = protect ? nullptr : &ram[page << 12];
+
+#ifdef __linux__
+    // Make the page read-only for fastmem stores, which will fault and take the slow path instead
+    if (fastWrite)
+        mprotect(fastWrite + (page << 12), 0x1000, protect ? PROT_READ : (PROT_READ | PROT_WRITE));
+#endif
+}
+
+uint8_t *Memory::getRam(uint32_t address, uint32_t size) {
+    // Get a direct pointer to a range of memory, if it lies within a single mirror of RAM
+    if (address >= 0x40000000 || (address & 0x3FFFFF) + size > 0x400000)
+        return nullptr;
+    return &ram[address & 0x3FFFFF];
 }
 
 template uint8_t Memory::read(uint32_t address);
 template uint16_t Memory::read(uint32_t address);
 template uint32_t Memory::read(uint32_t address);
 template <typename T> T Memory::read(uint32_t address) {
-    // Read an LSB-first value from an aligned RAM address or I/O register
-    if ((address &= ~(sizeof(T) - 1)) < 0x40000000) {
-        T value = 0;
-        uint8_t *data = &ram[address & 0x3FFFFF];
-        for (uint32_t i = 0; i < sizeof(T); i++)
-            value |= data[i] << (i * 8);
+    // Read an LSB-first value from an aligned address, directly if its page is mapped
+    address &= ~(sizeof(T) - 1);
+    if (uint8_t *data = readMap[address >> 12]) {
+        T value;
+        memcpy(&value, &data[address & 0xFFF], sizeof(T));
         return value;
     }
     else if ((address >> 28) >= 0xE) {
@@ -89,11 +219,22 @@ template void Memory::write(uint32_t address, uint8_t value);
 template void Memory::write(uint32_t address, uint16_t value);
 template void Memory::write(uint32_t address, uint32_t value);
 template <typename T> void Memory::write(uint32_t address, T value) {
-    // Write an LSB-first value to an aligned RAM address or I/O register
-    if ((address &= ~(sizeof(T) - 1)) < 0x40000000) {
-        uint8_t *data = &ram[address & 0x3FFFFF];
-        for (uint32_t i = 0; i < sizeof(T); i++)
-            data[i] = value >> (i * 8);
+    // Write an LSB-first value to an aligned address, directly if its page is mapped
+    address &= ~(sizeof(T) - 1);
+    if (uint8_t *data = writeMap[address >> 12]) {
+        memcpy(&data[address & 0xFFF], &value, sizeof(T));
+        return;
+    }
+    else if (address < 0x40000000) {
+        // Invalidate decoded ARM9 code and mark framebuffer and rewind changes in watched RAM pages before writing
+        uint8_t watches = pageWatches[(address & 0x3FFFFF) >> 12];
+        if (watches & WATCH_CODE)
+            Arm9::invalidateBlocks(address);
+        if (watches & WATCH_FRAME)
+            Display::markDirty(address);
+        if (watches & WATCH_REWIND)
+            Rewind::markWritten(address);
+        memcpy(&ram[address & 0x3FFFFF], &value, sizeof(T));
         return;
     }
     else if ((address >> 28) >= 0xE) {
@@ -112,110 +253,25 @@ template <typename T> T Memory::ioRead(uint32_t address) {
     // Read a value from one or more I/O registers
     T value = 0;
     for (uint32_t i = 0; i < sizeof(T);) {
-        // Load data from a register
-        uint32_t base, size, data;
-        switch (base = address + i) {
-            DEF_IO32(0xE0010010, data = Wifi::readResponse(0))
-            DEF_IO32(0xE0010014, data = Wifi::readResponse(1))
-            DEF_IO32(0xE0010018, data = Wifi::readResponse(2))
-            DEF_IO32(0xE001001C, data = Wifi::readResponse(3))
-            DEF_IO32(0xE0010020, data = Wifi::readBufferData())
-            DEF_IO16(0xE001002C, data = Wifi::readClockCtrl())
-            DEF_IO16(0xE0010030, data = Wifi::readIrqFlags())
-            DEF_IO32(0xE0010034, data = Wifi::readIrqEnable())
-            DEF_IO32(0xE0010040, data = 0x69EF30B0) // WiFi capabilities
-            DEF_IO32(0xF0000000, data = 0x00041040) // Hardware ID
-            DEF_IO32(0xF0000408, data = Timers::readCounter())
-            DEF_IO32(0xF0000410, data = Timers::readControl(0))
-            DEF_IO32(0xF0000414, data = Timers::readTimer(0))
-            DEF_IO32(0xF0000420, data = Timers::readControl(1))
-            DEF_IO32(0xF0000424, data = Timers::readTimer(1))
-            DEF_IO32(0xF0001208, data = Interrupts::readIrqEnable(0))
-            DEF_IO32(0xF000120C, data = Interrupts::readIrqEnable(1))
-            DEF_IO32(0xF0001210, data = Interrupts::readIrqEnable(2))
-            DEF_IO32(0xF0001214, data = Interrupts::readIrqEnable(3))
-            DEF_IO32(0xF0001218, data = Interrupts::readIrqEnable(4))
-            DEF_IO32(0xF000121C, data = Interrupts::readIrqEnable(5))
-            DEF_IO32(0xF0001220, data = Interrupts::readIrqEnable(6))
-            DEF_IO32(0xF0001224, data = Interrupts::readIrqEnable(7))
-            DEF_IO32(0xF0001228, data = Interrupts::readIrqEnable(8))
-            DEF_IO32(0xF000122C, data = Interrupts::readIrqEnable(9))
-            DEF_IO32(0xF0001230, data = Interrupts::readIrqEnable(10))
-            DEF_IO32(0xF0001234, data = Interrupts::readIrqEnable(11))
-            DEF_IO32(0xF0001238, data = Interrupts::readIrqEnable(12))
-            DEF_IO32(0xF000123C, data = Interrupts::readIrqEnable(13))
-            DEF_IO32(0xF0001240, data = Interrupts::readIrqEnable(14))
-            DEF_IO32(0xF0001244, data = Interrupts::readIrqEnable(15))
-            DEF_IO32(0xF0001248, data = Interrupts::readIrqEnable(16))
-            DEF_IO32(0xF000124C, data = Interrupts::readIrqEnable(17))
-            DEF_IO32(0xF0001250, data = Interrupts::readIrqEnable(18))
-            DEF_IO32(0xF0001254, data = Interrupts::readIrqEnable(19))
-            DEF_IO32(0xF0001258, data = Interrupts::readIrqEnable(20))
-            DEF_IO32(0xF000125C, data = Interrupts::readIrqEnable(21))
-            DEF_IO32(0xF0001260, data = Interrupts::readIrqEnable(22))
-            DEF_IO32(0xF0001264, data = Interrupts::readIrqEnable(23))
-            DEF_IO32(0xF0001268, data = Interrupts::readIrqEnable(24))
-            DEF_IO32(0xF000126C, data = Interrupts::readIrqEnable(25))
-            DEF_IO32(0xF0001270, data = Interrupts::readIrqEnable(26))
-            DEF_IO32(0xF0001274, data = Interrupts::readIrqEnable(27))
-            DEF_IO32(0xF0001278, data = Interrupts::readIrqEnable(28))
-            DEF_IO32(0xF000127C, data = Interrupts::readIrqEnable(29))
-            DEF_IO32(0xF0001280, data = Interrupts::readIrqEnable(30))
-            DEF_IO32(0xF0001284, data = Interrupts::readIrqEnable(31))
-            DEF_IO32(0xF00013F0, data = Interrupts::readIrqIndex())
-            DEF_IO32(0xF00013F8, data = Interrupts::readPrioMask())
-            DEF_IO32(0xF00013FC, data = Interrupts::readPrioClear())
-            DEF_IO32(0xF00019F8, data = Interrupts::readPrioMask())
-            DEF_IO32(0xF00019FC, data = Interrupts::readPrioClear())
-            DEF_IO32(0xF0004050, data = Dma::readSpiCount())
-            DEF_IO32(0xF0004114, data = Dma::readCount(0))
-            DEF_IO32(0xF0004154, data = Dma::readCount(1))
-            DEF_IO32(0xF0004194, data = Dma::readCount(2))
-            DEF_IO32(0xF0004404, data = Spi::readControl())
-            DEF_IO32(0xF0004408, data = Spi::readIrqFlags())
-            DEF_IO32(0xF000440C, data = Spi::readFifoStat())
-            DEF_IO32(0xF0004410, data = Spi::readData())
-            DEF_IO32(0xF0004418, data = Spi::readIrqEnable())
-            DEF_IO32(0xF0005800, data = I2c::readIrqFlags())
-            DEF_IO32(0xF0005804, data = I2c::readIrqEnable())
-            DEF_IO32(0xF0005C00, data = 0x1) // I2C stub
-            DEF_IO32(0xF0005C04, data = I2c::readData(0))
-            DEF_IO32(0xF0005C08, data = I2c::readControl(0))
-            DEF_IO32(0xF0005C18, data = I2c::readStatus(0))
-            DEF_IO32(0xF0006000, data = 0x1) // I2C stub
-            DEF_IO32(0xF0006004, data = I2c::readData(1))
-            DEF_IO32(0xF0006008, data = I2c::readControl(1))
-            DEF_IO32(0xF0006018, data = I2c::readStatus(1))
-            DEF_IO32(0xF0006400, data = 0x1) // I2C stub
-            DEF_IO32(0xF0006404, data = I2c::readData(2))
-            DEF_IO32(0xF0006408, data = I2c::readControl(2))
-            DEF_IO32(0xF0006418, data = I2c::readStatus(2))
-            DEF_IO32(0xF0006800, data = 0x1) // I2C stub
-            DEF_IO32(0xF0006804, data = I2c::readData(3))
-            DEF_IO32(0xF0006808, data = I2c::readControl(3))
-            DEF_IO32(0xF0006818, data = I2c::readStatus(3))
-            DEF_IO32(0xF0009410, data = Display::readFbXOfs()) // Stub
-            DEF_IO32(0xF0009460, data = Display::readFbXOfs())
-            DEF_IO32(0xF0009464, data = Display::readFbWidth())
-            DEF_IO32(0xF0009468, data = Display::readFbYOfs())
-            DEF_IO32(0xF000946C, data = Display::readFbHeight())
-            DEF_IO32(0xF0009474, data = Display::readFbAddr())
-
-        default:
-            // Handle unknown reads by returning nothing
+        // Handle unknown reads by returning nothing, or ignore them after the first byte
+        IoReg *reg = findIo(ioReads, address + i);
+        if (!reg) {
             if (i == 0) {
                 printf("Unknown I/O register read: 0x%X\n", address);
                 return 0;
             }
-
-            // Ignore unknown reads after the first byte
             i++;
             continue;
         }
 
+        // Load data from the register, noting if it isn't stable for idle loop detection
+        uint32_t base = address + i - reg->address;
+        if (!reg->stable) volatileRead = true;
+        uint32_t data = (*reg->read)(reg->index);
+
         // Add data to the return value and adjust byte offset
         value |= (data >> (base * 8)) << (i * 8);
-        i += size - base;
+        i += reg->size - base;
     }
     return value;
 }
@@ -227,130 +283,23 @@ template <typename T> void Memory::ioWrite(uint32_t address, T value) {
 
     // Write a value to one or more I/O registers
     for (uint32_t i = 0; i < sizeof(T);) {
-        // Store data to a register
-        uint32_t base, size, data = value >> (i * 8);
-        uint32_t mask = (1ULL << ((sizeof(T) - i) * 8)) - 1;
-        switch (base = address + i) {
-            DEF_IO32(0xE0010008, Wifi::writeArgs(IOWR_PARAMS))
-            DEF_IO16(0xE001000E, Wifi::writeCommand(IOWR_PARAMS))
-            DEF_IO16(0xE001002C, Wifi::writeClockCtrl(IOWR_PARAMS))
-            DEF_IO16(0xE0010030, Wifi::writeIrqFlags(IOWR_PARAMS))
-            DEF_IO16(0xE0010034, Wifi::writeIrqEnable(IOWR_PARAMS))
-            DEF_IO32(0xF0000400, Timers::writeTimerScale(IOWR_PARAMS))
-            DEF_IO32(0xF0000404, Timers::writeCountScale(IOWR_PARAMS))
-            DEF_IO32(0xF0000408, Timers::writeCounter(IOWR_PARAMS))
-            DEF_IO32(0xF0000410, Timers::writeControl(0, IOWR_PARAMS))
-            DEF_IO32(0xF0000414, Timers::writeTimer(0, IOWR_PARAMS))
-            DEF_IO32(0xF0000418, Timers::writeTarget(0, IOWR_PARAMS))
-            DEF_IO32(0xF0000420, Timers::writeControl(1, IOWR_PARAMS))
-            DEF_IO32(0xF0000424, Timers::writeTimer(1, IOWR_PARAMS))
-            DEF_IO32(0xF0000428, Timers::writeTarget(1, IOWR_PARAMS))
-            DEF_IO32(0xF0001208, Interrupts::writeIrqEnable(0, IOWR_PARAMS))
-            DEF_IO32(0xF000120C, Interrupts::writeIrqEnable(1, IOWR_PARAMS))
-            DEF_IO32(0xF0001210, Interrupts::writeIrqEnable(2, IOWR_PARAMS))
-            DEF_IO32(0xF0001214, Interrupts::writeIrqEnable(3, IOWR_PARAMS))
-            DEF_IO32(0xF0001218, Interrupts::writeIrqEnable(4, IOWR_PARAMS))
-            DEF_IO32(0xF000121C, Interrupts::writeIrqEnable(5, IOWR_PARAMS))
-            DEF_IO32(0xF0001220, Interrupts::writeIrqEnable(6, IOWR_PARAMS))
-            DEF_IO32(0xF0001224, Interrupts::writeIrqEnable(7, IOWR_PARAMS))
-            DEF_IO32(0xF0001228, Interrupts::writeIrqEnable(8, IOWR_PARAMS))
-            DEF_IO32(0xF000122C, Interrupts::writeIrqEnable(9, IOWR_PARAMS))
-            DEF_IO32(0xF0001230, Interrupts::writeIrqEnable(10, IOWR_PARAMS))
-            DEF_IO32(0xF0001234, Interrupts::writeIrqEnable(11, IOWR_PARAMS))
-            DEF_IO32(0xF0001238, Interrupts::writeIrqEnable(12, IOWR_PARAMS))
-            DEF_IO32(0xF000123C, Interrupts::writeIrqEnable(13, IOWR_PARAMS))
-            DEF_IO32(0xF0001240, Interrupts::writeIrqEnable(14, IOWR_PARAMS))
-            DEF_IO32(0xF0001244, Interrupts::writeIrqEnable(15, IOWR_PARAMS))
-            DEF_IO32(0xF0001248, Interrupts::writeIrqEnable(16, IOWR_PARAMS))
-            DEF_IO32(0xF000124C, Interrupts::writeIrqEnable(17, IOWR_PARAMS))
-            DEF_IO32(0xF0001250, Interrupts::writeIrqEnable(18, IOWR_PARAMS))
-            DEF_IO32(0xF0001254, Interrupts::writeIrqEnable(19, IOWR_PARAMS))
-            DEF_IO32(0xF0001258, Interrupts::writeIrqEnable(20, IOWR_PARAMS))
-            DEF_IO32(0xF000125C, Interrupts::writeIrqEnable(21, IOWR_PARAMS))
-            DEF_IO32(0xF0001260, Interrupts::writeIrqEnable(22, IOWR_PARAMS))
-            DEF_IO32(0xF0001264, Interrupts::writeIrqEnable(23, IOWR_PARAMS))
-            DEF_IO32(0xF0001268, Interrupts::writeIrqEnable(24, IOWR_PARAMS))
-            DEF_IO32(0xF000126C, Interrupts::writeIrqEnable(25, IOWR_PARAMS))
-            DEF_IO32(0xF0001270, Interrupts::writeIrqEnable(26, IOWR_PARAMS))
-            DEF_IO32(0xF0001274, Interrupts::writeIrqEnable(27, IOWR_PARAMS))
-            DEF_IO32(0xF0001278, Interrupts::writeIrqEnable(28, IOWR_PARAMS))
-            DEF_IO32(0xF000127C, Interrupts::writeIrqEnable(29, IOWR_PARAMS))
-            DEF_IO32(0xF0001280, Interrupts::writeIrqEnable(30, IOWR_PARAMS))
-            DEF_IO32(0xF0001284, Interrupts::writeIrqEnable(31, IOWR_PARAMS))
-            DEF_IO32(0xF00013F8, Interrupts::writePrioMask(IOWR_PARAMS))
-            DEF_IO32(0xF00019F8, Interrupts::writePrioMask(IOWR_PARAMS))
-            DEF_IO32(0xF0004040, Dma::writeSpiEnable(IOWR_PARAMS))
-            DEF_IO32(0xF0004044, Dma::writeSpiControl(IOWR_PARAMS))
-            DEF_IO32(0xF0004050, Dma::writeSpiCount(IOWR_PARAMS))
-            DEF_IO32(0xF0004054, Dma::writeSpiAddress(IOWR_PARAMS))
-            DEF_IO32(0xF0004100, Dma::writeEnable(0, IOWR_PARAMS))
-            DEF_IO32(0xF0004104, Dma::writeControl(0, IOWR_PARAMS))
-            DEF_IO32(0xF0004108, Dma::writeChunkSize(0, IOWR_PARAMS))
-            DEF_IO32(0xF000410C, Dma::writeSrcStride(0, IOWR_PARAMS))
-            DEF_IO32(0xF0004110, Dma::writeDstStride(0, IOWR_PARAMS))
-            DEF_IO32(0xF0004114, Dma::writeCount(0, IOWR_PARAMS))
-            DEF_IO32(0xF0004118, Dma::writeSrcAddr(0, IOWR_PARAMS))
-            DEF_IO32(0xF000411C, Dma::writeDstAddr(0, IOWR_PARAMS))
-            DEF_IO32(0xF0004120, Dma::writeSimpFill(0, IOWR_PARAMS))
-            DEF_IO32(0xF0004140, Dma::writeEnable(1, IOWR_PARAMS))
-            DEF_IO32(0xF0004144, Dma::writeControl(1, IOWR_PARAMS))
-            DEF_IO32(0xF0004148, Dma::writeChunkSize(1, IOWR_PARAMS))
-            DEF_IO32(0xF000414C, Dma::writeSrcStride(1, IOWR_PARAMS))
-            DEF_IO32(0xF0004150, Dma::writeDstStride(1, IOWR_PARAMS))
-            DEF_IO32(0xF0004154, Dma::writeCount(1, IOWR_PARAMS))
-            DEF_IO32(0xF0004158, Dma::writeSrcAddr(1, IOWR_PARAMS))
-            DEF_IO32(0xF000415C, Dma::writeDstAddr(1, IOWR_PARAMS))
-            DEF_IO32(0xF0004160, Dma::writeSimpFill(1, IOWR_PARAMS))
-            DEF_IO32(0xF0004180, Dma::writeEnable(2, IOWR_PARAMS))
-            DEF_IO32(0xF0004184, Dma::writeControl(2, IOWR_PARAMS))
-            DEF_IO32(0xF0004188, Dma::writeChunkSize(2, IOWR_PARAMS))
-            DEF_IO32(0xF000418C, Dma::writeSrcStride(2, IOWR_PARAMS))
-            DEF_IO32(0xF0004190, Dma::writeDstStride(2, IOWR_PARAMS))
-            DEF_IO32(0xF0004194, Dma::writeCount(2, IOWR_PARAMS))
-            DEF_IO32(0xF0004198, Dma::writeSrcAddr(2, IOWR_PARAMS))
-            DEF_IO32(0xF000419C, Dma::writeDstAddr(2, IOWR_PARAMS))
-            DEF_IO32(0xF00041A0, Dma::writeSimpFill(2, IOWR_PARAMS))
-            DEF_IO32(0xF0004404, Spi::writeControl(IOWR_PARAMS))
-            DEF_IO32(0xF0004408, Spi::writeIrqFlags(IOWR_PARAMS))
-            DEF_IO32(0xF0004410, Spi::writeData(IOWR_PARAMS))
-            DEF_IO32(0xF0004418, Spi::writeIrqEnable(IOWR_PARAMS))
-            DEF_IO32(0xF0004420, Spi::writeReadCount(IOWR_PARAMS))
-            DEF_IO32(0xF0004424, Spi::writeDevSelect(IOWR_PARAMS))
-            DEF_IO32(0xF00050F8, Spi::writeGpioFlash(IOWR_PARAMS))
-            DEF_IO32(0xF00050FC, Spi::writeGpioUic(IOWR_PARAMS))
-            DEF_IO32(0xF0005804, I2c::writeIrqEnable(IOWR_PARAMS))
-            DEF_IO32(0xF0005808, I2c::writeIrqAck(IOWR_PARAMS))
-            DEF_IO32(0xF0005C04, I2c::writeData(0, IOWR_PARAMS))
-            DEF_IO32(0xF0005C08, I2c::writeControl(0, IOWR_PARAMS))
-            DEF_IO32(0xF0006004, I2c::writeData(1, IOWR_PARAMS))
-            DEF_IO32(0xF0006008, I2c::writeControl(1, IOWR_PARAMS))
-            DEF_IO32(0xF0006404, I2c::writeData(2, IOWR_PARAMS))
-            DEF_IO32(0xF0006408, I2c::writeControl(2, IOWR_PARAMS))
-            DEF_IO32(0xF0006804, I2c::writeData(3, IOWR_PARAMS))
-            DEF_IO32(0xF0006808, I2c::writeControl(3, IOWR_PARAMS))
-            DEF_IO32(0xF0009460, Display::writeFbXOfs(IOWR_PARAMS))
-            DEF_IO32(0xF0009464, Display::writeFbWidth(IOWR_PARAMS))
-            DEF_IO32(0xF0009468, Display::writeFbYOfs(IOWR_PARAMS))
-            DEF_IO32(0xF000946C, Display::writeFbHeight(IOWR_PARAMS))
-            DEF_IO32(0xF0009470, Display::writeFbStride(IOWR_PARAMS))
-            DEF_IO32(0xF0009474, Display::writeFbAddr(IOWR_PARAMS))
-            DEF_IO32(0xF00094B0, Display::writePixelFmt(IOWR_PARAMS))
-            DEF_IO32(0xF0009500, Display::writePalAddr(IOWR_PARAMS))
-            DEF_IO32(0xF0009504, Display::writePalData(IOWR_PARAMS))
-
-        default:
-            // Handle unknown writes by doing nothing
+        // Handle unknown writes by doing nothing, or ignore them after the first byte
+        IoReg *reg = findIo(ioWrites, address + i);
+        if (!reg) {
             if (i == 0) {
                 printf("Unknown I/O register write: 0x%X @ 0x%X\n", value, address);
                 return;
             }
-
-            // Ignore unknown writes after the first byte
             i++;
             continue;
         }
 
+        // Store data to the register
+        uint32_t base = address + i - reg->address, data = value >> (i * 8);
+        uint32_t mask = (1ULL << ((sizeof(T) - i) * 8)) - 1;
+        (*reg->write)(reg->index, mask << (base * 8), data << (base * 8));
+
         // Adjust the byte offset
-        i += size - base;
+        i += reg->size - base;
     }
 }
@@ -21,8 +21,35 @@
 
 #include <cstdint>
 
+// Adapts an I/O function that takes no register index to a table callback
+#define IO_READ(func) [](int) -> uint32_t { return func(); }
+#define IO_WRITE(func) [](int, uint32_t mask, uint32_t value) { func(mask, value); }
+
+// Reasons for sending writes to a RAM page through the slow path
+enum PageWatch {
+    WATCH_CODE = 1 << 0, // The page holds decoded ARM9 code
+    WATCH_FRAME = 1 << 1, // The page holds part of the displayed framebuffer
+    WATCH_REWIND = 1 << 2 // The page hasn't been written since the last rewind capture
+};
+
 namespace Memory {
+    typedef uint32_t (*IoRead)(int index);
+    typedef void (*IoWrite)(int index, uint32_t mask, uint32_t value);
+
+    extern uint8_t *ram;
+    extern uint8_t *fastRead;
+    extern uint8_t *fastWrite;
+    extern uint8_t *readMap[0x100000];
+    extern uint8_t *writeMap[0x100000];
+    extern uint8_t pageWatches[0x400];
+    extern bool volatileRead;
+
+    bool initFastmem();
     void reset();
+    void protectPage(uint32_t address, PageWatch watch, bool protect);
+    uint8_t *getRam(uint32_t address, uint32_t size);
+    void registerRead(uint32_t address, uint8_t size, IoRead read, int index = 0, bool stable = true);
+    void registerWrite(uint32_t address, uint8_t size, IoWrite write, int index = 0);
     template <typename T> T read(uint32_t address);
     template <typename T> void write(uint32_t address, T value);
 }
@@ -0,0 +1,299 @@
+/*
+    Copyright 2024 Hydr8gon
+
+    This file is part of GamePawd.
+
+    GamePawd is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GamePawd is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "rewind.h"
+#include "core.h"
+#include "memory.h"
+#include "state.h"
+
+// One captured frame, holding the device state then and what the RAM pages written since the last capture held before
+struct RewindEntry {
+    std::vector<uint8_t> devices;
+    std::vector<uint16_t> pages;
+    std::vector<uint8_t> data;
+    bool packed = false;
+
+    size_t size() const { return devices.size() + pages.size() * sizeof(uint16_t) + data.size(); }
+};
+
+namespace Rewind {
+    // How much history to keep, with rewinding disabled at zero frames
+    uint32_t maxFrames;
+    size_t maxBytes;
+    int captureEvent = -1;
+    std::atomic<uint32_t> requested;
+
+    // RAM as of the last capture, and which pages were written since
+    uint8_t shadow[0x400000];
+    uint8_t written[0x400];
+
+    // Captured frames, oldest first, shared with the thread that compresses them
+    std::deque<RewindEntry*> entries;
+    size_t usedBytes;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread *packThread;
+    bool packing;
+
+    // Statistics for the cost of rewinding
+    uint64_t captures;
+    double captureTime;
+    double maxCaptureTime;
+    uint64_t rawBytes;
+    uint64_t packedBytes;
+
+    void capture();
+    void packLoop();
+    void pack(RewindEntry *entry);
+    void clear(std::unique_lock<std::mutex> &lock);
+    void drain(std::unique_lock<std::mutex> &lock);
+}
+
+void Rewind::setLimits(uint32_t frames, size_t bytes) {
+    // Set how many frames and bytes of history to keep, or disable rewinding with zero frames, taking effect on reset
+    maxFrames = frames;
+    maxBytes = bytes;
+}
+
+void Rewind::startThread() {
+    // Start the compression thread if it wasn't running and rewinding is enabled
+    if (packThread || !maxFrames) return;
+    packing = true;
+    packThread = new std::thread(packLoop);
+}
+
+void Rewind::stopThread() {
+    // Stop the compression thread once it finishes the frames it was given
+    if (!packThread) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        packing = false;
+    }
+    cond.notify_all();
+    packThread->join();
+    delete packThread;
+    packThread = nullptr;
+}
+
+void Rewind::reset() {
+    // Register the capture task even when disabled, so save states refer to tasks the same way either way
+    Core::registerTask(capture, &captureEvent);
+    requested = 0;
+
+    // Drop all history, and start capturing every frame if enabled
+    if (maxFrames) {
+        Core::schedule(captureEvent, capture, 108000000 / 60);
+        restart();
+    }
+    else {
+        std::unique_lock<std::mutex> lock(mutex);
+        clear(lock);
+    }
+
+    // Start the statistics over once nothing is left compressing
+    captures = 0;
+    captureTime = maxCaptureTime = 0;
+    rawBytes = packedBytes = 0;
+}
+
+void Rewind::restart() {
+    // Drop all history and start tracking RAM changes from its current contents, after it was replaced as a whole
+    if (!maxFrames) return;
+    std::unique_lock<std::mutex> lock(mutex);
+    clear(lock);
+    memcpy(shadow, Memory::ram, sizeof(shadow));
+    memset(written, 0, sizeof(written));
+    for (uint32_t i = 0; i < 0x400; i++)
+        Memory::protectPage(i << 12, WATCH_REWIND, true);
+}
+
+void Rewind::clear(std::unique_lock<std::mutex> &lock) {
+    // Free all captured frames once the compression thread is done with them
+    drain(lock);
+    for (uint32_t i = 0; i < entries.size(); i++)
+        delete entries[i];
+    entries.clear();
+    usedBytes = 0;
+}
+
+void Rewind::drain(std::unique_lock<std::mutex> &lock) {
+    // Wait for every captured frame to be compressed, which happens oldest first
+    cond.wait(lock, [] { return entries.empty() || entries.back()->packed; });
+}
+
+void Rewind::markWritten(uint32_t address) {
+    // Mark a RAM page as changed since the last capture, and let further writes through until the next one
+    written[(address & 0x3FFFFF) >> 12] = 1;
+    Memory::protectPage(address, WATCH_REWIND, false);
+}
+
+void Rewind::request(uint32_t frames) {
+    // Ask to step back at the next capture if rewinding is enabled, which is safe to call from any thread
+    if (maxFrames) requested += frames;
+}
+
+void Rewind::capture() {
+    // Stop capturing if disabled, such as after loading a state saved with rewinding enabled
+    if (!maxFrames) return;
+
+    // Schedule the next capture first, so it's part of the saved state and keeps going after stepping back
+    Core::schedule(captureEvent, capture, 108000000 / 60);
+    if (uint32_t frames = requested.exchange(0)) {
+        stepBack(frames);
+        return;
+    }
+
+    // Save the device state, and what written RAM pages held before updating the shadow copy
+    auto start = std::chrono::steady_clock::now();
+    RewindEntry *entry = new RewindEntry();
+    Core::saveDevices(entry->devices);
+    for (uint32_t i = 0; i < 0x400; i++) {
+        if (!written[i]) continue;
+        entry->pages.push_back(i);
+        entry->data.insert(entry->data.end(), &shadow[i << 12], &shadow[(i + 1) << 12]);
+        memcpy(&shadow[i << 12], &Memory::ram[i << 12], 0x1000);
+        written[i] = 0;
+        Memory::protectPage(i << 12, WATCH_REWIND, true);
+    }
+    rawBytes += entry->size();
+
+    // Keep the frame, handing it to the compression thread or compressing it here if there isn't one
+    std::unique_lock<std::mutex> lock(mutex);
+    entries.push_back(entry);
+    usedBytes += entry->size();
+    if (!packThread) {
+        lock.unlock();
+        pack(entry);
+        lock.lock();
+    }
+    cond.notify_all();
+
+    // Drop the oldest frames to stay within the limits, which waits for the thread if it falls behind
+    while (entries.size() > maxFrames || (usedBytes > maxBytes && entries.size() > 1)) {
+        RewindEntry *oldest = entries.front();
+        if (!oldest->packed) {
+            cond.wait(lock);
+            continue;
+        }
+        usedBytes -= oldest->size();
+        entries.pop_front();
+        delete oldest;
+    }
+    lock.unlock();
+
+    // Track how long capturing takes, since it stalls emulation
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+    captureTime += time.count();
+    maxCaptureTime = std::max(maxCaptureTime, time.count());
+    captures++;
+}
+
+void Rewind::packLoop() {
+    while (true) {
+        // Wait for a captured frame to compress, or exit when stopped with nothing left
+        std::unique_lock<std::mutex> lock(mutex);
+        RewindEntry *entry = nullptr;
+        cond.wait(lock, [&] {
+            for (uint32_t i = 0; i < entries.size() && !entry; i++)
+                if (!entries[i]->packed) entry = entries[i];
+            return entry || !packing;
+        });
+        if (!entry) return;
+
+        // Compress it without holding the lock, since nothing else touches a frame until it's packed
+        lock.unlock();
+        pack(entry);
+        cond.notify_all();
+    }
+}
+
+void Rewind::pack(RewindEntry *entry) {
+    // Compress a frame's RAM pages, then swap them in and account for the change
+    std::vector<uint8_t> packed;
+    StateFile::compress(packed, entry->data.data(), entry->data.size());
+    packed.shrink_to_fit();
+    std::lock_guard<std::mutex> lock(mutex);
+    usedBytes -= entry->size();
+    entry->data.swap(packed);
+    entry->packed = true;
+    usedBytes += entry->size();
+    packedBytes += entry->size();
+}
+
+bool Rewind::stepBack(uint32_t frames) {
+    // Find the frame to go back to, with one frame back being the latest capture
+    // This must be called while the emulator is stopped, or from the emulation thread
+    std::unique_lock<std::mutex> lock(mutex);
+    drain(lock);
+    if (entries.empty() || !frames) return false;
+    size_t target = entries.size() - std::min<size_t>(frames, entries.size());
+
+    // Undo RAM writes since the latest capture using the shadow copy
+    for (uint32_t i = 0; i < 0x400; i++)
+        if (written[i]) memcpy(&Memory::ram[i << 12], &shadow[i << 12], 0x1000);
+
+    // Undo the writes before each newer capture, newest first, dropping those frames
+    std::vector<uint8_t> data;
+    while (entries.size() > target + 1) {
+        RewindEntry *entry = entries.back();
+        data.resize(entry->pages.size() << 12);
+        if (!StateFile::decompress(data.data(), data.size(), entry->data))
+            printf("Corrupted rewind history\n");
+        for (uint32_t i = 0; i < entry->pages.size(); i++)
+            memcpy(&Memory::ram[entry->pages[i] << 12], &data[i << 12], 0x1000);
+        usedBytes -= entry->size();
+        entries.pop_back();
+        delete entry;
+    }
+
+    // Track changes from the restored RAM, which the target frame's own pages still lead back from
+    memcpy(shadow, Memory::ram, sizeof(shadow));
+    for (uint32_t i = 0; i < 0x400; i++) {
+        if (!written[i]) continue;
+        written[i] = 0;
+        Memory::protectPage(i << 12, WATCH_REWIND, true);
+    }
+
+    // Load the device state of the target frame, which has the next capture scheduled already
+    std::vector<uint8_t> devices(entries[target]->devices);
+    lock.unlock();
+    return Core::loadDevices(devices);
+}
+
+void Rewind::printStats() {
+    // Report how much memory the history takes and what capturing costs per frame, if it was enabled
+    if (!maxFrames) return;
+    std::lock_guard<std::mutex> lock(mutex);
+    printf("Rewind: %zu frames in %.2f MB (limit %u frames, %.2f MB)\n", entries.size(),
+        usedBytes / 1048576.0, maxFrames, maxBytes / 1048576.0);
+    printf("Rewind capture: %.3f ms average, %.3f ms max, deltas compressed to %.1f%%\n",
+        captures ? captureTime * 1000 / captures : 0.0, maxCaptureTime * 1000,
+        rawBytes ? packedBytes * 100.0 / rawBytes : 0.0);
+}
@@ -21,8 +21,10 @@
 #include <cstdio>
 
 #include "spi.h"
+#include "input.h"
 #include "interrupts.h"
 #include "memory.h"
+#include "state.h"
 
 namespace Spi {
     uint8_t eeprom[0x800];
@@ -30,6 +32,7 @@ namespace Spi {
     uint32_t flashAddr;
     uint32_t flashStart;
     uint32_t flashSize;
+    uint64_t flashHash;
 
     uint32_t writeCount;
     uint32_t address;
@@ -53,6 +56,7 @@ void Spi::reset() {
     flashAddr = 0;
     flashStart = 0;
     flashSize = 0;
+    flashHash = 0;
 
     // Reset the internal registers
     writeCount = 0;
@@ -68,6 +72,21 @@ void Spi::reset() {
     readCount = 0;
     devSelect = 0;
 
+    // Register the SPI I/O registers
+    Memory::registerRead(0xF0004404, 4, IO_READ(readControl));
+    Memory::registerRead(0xF0004408, 4, IO_READ(readIrqFlags));
+    Memory::registerRead(0xF000440C, 4, IO_READ(readFifoStat));
+    Memory::registerRead(0xF0004410, 4, IO_READ(readData), 0, false);
+    Memory::registerRead(0xF0004418, 4, IO_READ(readIrqEnable));
+    Memory::registerWrite(0xF0004404, 4, IO_WRITE(writeControl));
+    Memory::registerWrite(0xF0004408, 4, IO_WRITE(writeIrqFlags));
+    Memory::registerWrite(0xF0004410, 4, IO_WRITE(writeData));
+    Memory::registerWrite(0xF0004418, 4, IO_WRITE(writeIrqEnable));
+    Memory::registerWrite(0xF0004420, 4, IO_WRITE(writeReadCount));
+    Memory::registerWrite(0xF0004424, 4, IO_WRITE(writeDevSelect));
+    Memory::registerWrite(0xF00050F8, 4, IO_WRITE(writeGpioFlash));
+    Memory::registerWrite(0xF00050FC, 4, IO_WRITE(writeGpioUic));
+
     // Build a barebones UIC EEPROM with essential data
     eeprom[0x100] = 0x00; // Board version
     calcCrc16(&eeprom[0x100], 0x1);
@@ -137,6 +156,44 @@ void Spi::reset() {
         // Initialize values set by the bootloader
         Memory::write<uint8_t>(0x3FFFFC, 0x3F);
     }
+
+    // Hash the FLASH data with 64-bit FNV-1a, so firmware can be told apart
+    if (flashSize) {
+        flashHash = 0xCBF29CE484222325ULL;
+        for (uint32_t i = 0; i < flashSize; i++)
+            flashHash = (flashHash ^ flashData[i]) * 0x100000001B3ULL;
+    }
+}
+
+void Spi::syncState(State &state) {
+    // Save or load the EEPROM, buttons, and device state; FLASH data is reloaded from its file on reset
+    state.sync(eeprom);
+    state.sync(writeCount);
+    state.sync(address);
+    state.sync(buttons);
+    state.sync(flashStatus);
+    state.sync(command);
+    state.sync(uicFwStatus);
+    state.sync(control);
+    state.sync(irqFlags);
+    state.sync(irqEnable);
+    state.sync(readCount);
+    state.sync(devSelect);
+
+    // Save or load the FLASH mapping, rejecting states made with a different size of FLASH data
+    uint32_t size = flashSize;
+    state.sync(flashAddr);
+    state.sync(flashStart);
+    state.sync(size);
+    if (state.loading && size != flashSize) {
+        printf("Saved state was made with different FLASH data\n");
+        state.failed = true;
+    }
+}
+
+uint64_t Spi::firmwareHash() {
+    // Get the hash of the loaded FLASH data, or zero if nothing was loaded
+    return flashHash;
 }
 
 void Spi::calcCrc16(uint8_t *data, uint32_t size) {
@@ -153,14 +210,14 @@ void Spi::calcCrc16(uint8_t *data, uint32_t size) {
     data[size + 1] = crc >> 8;
 }
 
-void Spi::pressKey(int key) {
-    // Set a button bit to press it
-    buttons |= (1 << key);
+uint16_t Spi::getButtons() {
+    // Get the bits of buttons that are pressed
+    return buttons;
 }
 
-void Spi::releaseKey(int key) {
-    // Clear a button bit to release it
-    buttons &= ~(1 << key);
+void Spi::setButtons(uint16_t value) {
+    // Set the bits of buttons that are pressed, which must be done on the emulation thread
+    buttons = value;
 }
 
 uint32_t Spi::readControl() {
@@ -229,7 +286,8 @@ uint32_t Spi::readData() {
             return 0x00;
 
         case 0x07: // Scan input
-            // Get the basic button bitmask and stub the rest
+            // Get the basic button bitmask as of this cycle and stub the rest
+            Input::update();
             switch (address++) {
                 case 0x02: return buttons >> 0;
                 case 0x03: return buttons >> 8;
@@ -21,10 +21,14 @@
 
 #include <cstdint>
 
+struct State;
+
 namespace Spi {
     void reset();
-    void pressKey(int key);
-    void releaseKey(int key);
+    void syncState(State &state);
+    uint64_t firmwareHash();
+    uint16_t getButtons();
+    void setButtons(uint16_t value);
 
     uint32_t readControl();
     uint32_t readIrqFlags();
@@ -0,0 +1,147 @@
+/*
+    Copyright 2024 Hydr8gon
+
+    This file is part of GamePawd.
+
+    GamePawd is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GamePawd is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstring>
+
+#include "state.h"
+
+void State::sync(void *value, size_t size) {
+    // Append a value when saving
+    if (!loading) {
+        data->insert(data->end(), (uint8_t*)value, (uint8_t*)value + size);
+        return;
+    }
+
+    // Read a value back when loading, zeroing it instead if the data runs out
+    if (offset + size > data->size()) {
+        memset(value, 0, size);
+        failed = true;
+        return;
+    }
+    memcpy(value, &(*data)[offset], size);
+    offset += size;
+}
+
+void StateFile::compress(std::vector<uint8_t> &dst, const uint8_t *src, size_t size) {
+    // Encode runs of a repeated byte as a length and the byte, and everything else as a length and the raw bytes
+    // Lengths are 15 bits, with the top bit of the first byte set for runs
+    for (size_t i = 0; i < size;) {
+        size_t run = 1;
+        while (i + run < size && run < 0x8000 && src[i + run] == src[i])
+            run++;
+        if (run >= 4) {
+            dst.push_back(0x80 | ((run - 1) >> 8));
+            dst.push_back(run - 1);
+            dst.push_back(src[i]);
+            i += run;
+            continue;
+        }
+
+        // Collect raw bytes until a run of at least 4 begins
+        size_t count = 0;
+        while (i + count < size && count < 0x8000) {
+            if (i + count + 3 < size && src[i + count] == src[i + count + 1] &&
+                src[i + count] == src[i + count + 2] && src[i + count] == src[i + count + 3])
+                break;
+            count++;
+        }
+        dst.push_back((count - 1) >> 8);
+        dst.push_back(count - 1);
+        dst.insert(dst.end(), &src[i], &src[i + count]);
+        i += count;
+    }
+}
+
+bool StateFile::decompress(uint8_t *dst, size_t size, const std::vector<uint8_t> &src) {
+    // Decode runs and raw bytes, failing if the data doesn't exactly fill the destination
+    size_t out = 0;
+    for (size_t i = 0; i + 1 < src.size();) {
+        size_t count = (((src[i] & 0x7F) << 8) | src[i + 1]) + 1;
+        bool run = (src[i] & 0x80);
+        i += 2;
+        if (out + count > size || i + (run ? 1 : count) > src.size())
+            return false;
+        if (run) {
+            memset(&dst[out], src[i], count);
+            i += 1;
+        }
+        else {
+            memcpy(&dst[out], &src[i], count);
+            i += count;
+        }
+        out += count;
+    }
+    return out == size;
+}
+
+bool SaveState::write(const char *path) const {
+    // Compress the device state and RAM together
+    std::vector<uint8_t> data(devices);
+    data.insert(data.end(), ram.begin(), ram.end());
+    std::vector<uint8_t> packed;
+    StateFile::compress(packed, data.data(), data.size());
+
+    // Write a header with a magic string, the version, and the sizes, followed by the compressed data
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        printf("Failed to open state file for writing: %s\n", path);
+        return false;
+    }
+    uint32_t header[] = { 0x53535047, STATE_VERSION, uint32_t(devices.size()), uint32_t(ram.size()) }; // "GPSS"
+    bool done = fwrite(header, sizeof(header), 1, file) == 1 &&
+        fwrite(packed.data(), sizeof(uint8_t), packed.size(), file) == packed.size();
+    fclose(file);
+    if (!done) printf("Failed to write state file: %s\n", path);
+    return done;
+}
+
+bool SaveState::read(const char *path) {
+    // Read the header, rejecting files that aren't states or were made by a different version
+    FILE *file = fopen(path, "rb");
+    if (!file) return false;
+    uint32_t header[4];
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != 0x53535047) {
+        printf("Not a state file: %s\n", path);
+        fclose(file);
+        return false;
+    }
+    if (header[1] != STATE_VERSION) {
+        printf("Unsupported state version %u in %s\n", header[1], path);
+        fclose(file);
+        return false;
+    }
+
+    // Read the rest of the file and decompress it
+    std::vector<uint8_t> packed;
+    uint8_t chunk[0x10000];
+    while (size_t count = fread(chunk, sizeof(uint8_t), sizeof(chunk), file))
+        packed.insert(packed.end(), chunk, chunk + count);
+    fclose(file);
+    std::vector<uint8_t> data(size_t(header[2]) + header[3]);
+    if (!StateFile::decompress(data.data(), data.size(), packed)) {
+        printf("Corrupt state file: %s\n", path);
+        return false;
+    }
+
+    // Split the data back into device state and RAM
+    devices.assign(data.begin(), data.begin() + header[2]);
+    ram.assign(data.begin() + header[2], data.end());
+    return true;
+}
@@ -0,0 +1,55 @@
+/*
+    Copyright 2024 Hydr8gon
+
+    This file is part of GamePawd.
+
+    GamePawd is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    GamePawd is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Bump whenever the layout of saved state changes, so old files are rejected
+#define STATE_VERSION 4
+
+// Reads or writes values with the same calls, so each part of the emulator lists its state once
+struct State {
+    std::vector<uint8_t> *data;
+    size_t offset;
+    bool loading;
+    bool failed;
+
+    State(std::vector<uint8_t> *data, bool loading): data(data), offset(0), loading(loading), failed(false) {}
+
+    void sync(void *value, size_t size);
+    template <typename T> void sync(T &value) { sync(&value, sizeof(T)); }
+};
+
+// A snapshot of the whole emulator, which can be kept in memory or written to a file
+struct SaveState {
+    std::vector<uint8_t> devices;
+    std::vector<uint8_t> ram;
+
+    bool write(const char *path) const;
+    bool read(const char *path);
+};
+
+// The byte-run encoding used by state files, also used to pack rewind history
+namespace StateFile {
+    void compress(std::vector<uint8_t> &dst, const uint8_t *src, size_t size);
+    bool decompress(uint8_t *dst, size_t size, const std::vector<uint8_t> &src);
+}
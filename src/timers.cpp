@@ -17,16 +17,20 @@
     along with GamePawd. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cstring>
 
 #include "timers.h"
 #include "core.h"
 #include "interrupts.h"
+#include "memory.h"
+#include "state.h"
 
 namespace Timers {
     uint8_t shifts[2];
-    uint32_t timerCycles;
-    uint32_t countCycles;
+    uint64_t timerCycles;
+    uint64_t countCycles;
+    int matchEvent = -1;
 
     uint64_t timers[2];
     uint32_t controls[2];
@@ -35,15 +39,17 @@ namespace Timers {
     uint32_t countScale;
     uint32_t counter;
 
-    void tickTimers();
-    void tickCounter();
+    uint64_t ticksToMatch(int i);
+    void updateTimers();
+    void scheduleMatch();
+    void matchTimers();
 }
 
 void Timers::reset() {
-    // Reset the prescale values
+    // Reset the prescale values and anchor tick timing at the current cycle
     memset(shifts, 0, sizeof(shifts));
-    countCycles = 0;
-    timerCycles = 0;
+    timerCycles = Core::globalCycles;
+    countCycles = Core::globalCycles;
 
     // Reset the I/O registers
     memset(timers, 0, sizeof(timers));
@@ -53,37 +59,90 @@ void Timers::reset() {
     countScale = 0;
     counter = 0;
 
-    // Schedule initial tasks
-    timerCycles = Core::schedule(tickTimers, timerScale + 1);
-    countCycles = Core::schedule(tickCounter, countScale + 1);
+    // Nothing can match until a timer is enabled
+    Core::registerTask(matchTimers, &matchEvent);
+    Core::cancel(matchEvent);
+
+    // Register the timer I/O registers
+    Memory::registerRead(0xF0000408, 4, IO_READ(readCounter), 0, false);
+    Memory::registerWrite(0xF0000400, 4, IO_WRITE(writeTimerScale));
+    Memory::registerWrite(0xF0000404, 4, IO_WRITE(writeCountScale));
+    Memory::registerWrite(0xF0000408, 4, IO_WRITE(writeCounter));
+    for (int i = 0; i < 2; i++) {
+        Memory::registerRead(0xF0000410 + i * 0x10, 4, readControl, i);
+        Memory::registerRead(0xF0000414 + i * 0x10, 4, readTimer, i, false);
+        Memory::registerWrite(0xF0000410 + i * 0x10, 4, writeControl, i);
+        Memory::registerWrite(0xF0000414 + i * 0x10, 4, writeTimer, i);
+        Memory::registerWrite(0xF0000418 + i * 0x10, 4, writeTarget, i);
+    }
+}
+
+void Timers::syncState(State &state) {
+    // Save or load the prescale values, tick anchors, and registers
+    state.sync(shifts);
+    state.sync(timerCycles);
+    state.sync(countCycles);
+    state.sync(timers);
+    state.sync(controls);
+    state.sync(targets);
+    state.sync(timerScale);
+    state.sync(countScale);
+    state.sync(counter);
+}
+
+uint64_t Timers::ticksToMatch(int i) {
+    // Get the number of ticks until a timer's pre-increment value matches its target, or 0 if it never will
+    uint64_t low = uint64_t(targets[i]) << shifts[i];
+    uint64_t high = uint64_t(targets[i] + 1ULL) << shifts[i];
+    if (timers[i] < low) return low - timers[i] + 1;
+    return (timers[i] < high) ? 1 : 0;
 }
 
-void Timers::tickTimers() {
-    // Verify timestamp and schedule the next tick
-    if (timerCycles != Core::globalCycles) return;
-    timerCycles = Core::schedule(tickTimers, timerScale + 1);
+void Timers::updateTimers() {
+    // Count the prescaled ticks that happened since the last update, keeping the tick phase
+    uint64_t ticks = (Core::globalCycles - timerCycles) / (timerScale + 1);
+    timerCycles += ticks * (timerScale + 1);
 
-    // Increment enabled timers and trigger an interrupt on reload
+    // Advance enabled timers, triggering an interrupt and reloading if the target was matched
     for (int i = 0; i < 2; i++) {
-        if ((controls[i] & 0x2) && (timers[i]++ >> shifts[i]) == targets[i]) {
-            Interrupts::requestIrq(i);
-            timers[i] = 0;
+        if (~controls[i] & 0x2) continue;
+        uint64_t match = ticksToMatch(i);
+        if (!match || match > ticks) {
+            timers[i] += ticks;
+            continue;
         }
+
+        // After a reload, the timer matches again every target + 1 prescaled steps
+        Interrupts::requestIrq(i);
+        timers[i] = (ticks - match) % ((uint64_t(targets[i]) << shifts[i]) + 1);
     }
 }
 
-void Timers::tickCounter() {
-    // Verify timestamp and schedule the next tick
-    if (countCycles != Core::globalCycles) return;
-    countCycles = Core::schedule(tickCounter, countScale + 1);
+void Timers::scheduleMatch() {
+    // Find the closest target match out of the enabled timers
+    uint64_t ticks = -1;
+    for (int i = 0; i < 2; i++) {
+        if (~controls[i] & 0x2) continue;
+        if (uint64_t match = ticksToMatch(i))
+            ticks = std::min(ticks, match);
+    }
 
-    // Increment the counter
-    counter++;
+    // Schedule an update at the match, or just cancel it if no timer will match
+    if (ticks == uint64_t(-1))
+        return Core::cancel(matchEvent);
+    uint64_t cycles = timerCycles + ticks * (timerScale + 1) - Core::globalCycles;
+    Core::schedule(matchEvent, matchTimers, std::min<uint64_t>(cycles, 0xFFFFFFFF));
+}
+
+void Timers::matchTimers() {
+    // Bring the timers up to date, which triggers the interrupt, and find the next match
+    updateTimers();
+    scheduleMatch();
 }
 
 uint32_t Timers::readCounter() {
-    // Read the current counter value
-    return counter;
+    // Read the current counter value, derived from cycles since the last change
+    return counter + (Core::globalCycles - countCycles) / (countScale + 1);
 }
 
 uint32_t Timers::readControl(int i) {
@@ -93,44 +152,60 @@ uint32_t Timers::readControl(int i) {
 
 uint32_t Timers::readTimer(int i) {
     // Read one of the current timer values, adjusted for prescaling
+    updateTimers();
     return timers[i] >> shifts[i];
 }
 
 void Timers::writeTimerScale(uint32_t mask, uint32_t value) {
-    // Write to the timer prescale register and reschedule its next tick
+    // Write to the timer prescale register and restart tick timing from now
+    updateTimers();
     timerScale = (timerScale & ~mask) | (value & mask);
-    timerCycles = Core::schedule(tickTimers, timerScale + 1);
+    timerCycles = Core::globalCycles;
+    scheduleMatch();
 }
 
 void Timers::writeCountScale(uint32_t mask, uint32_t value) {
-    // Write to the counter prescale register and reschedule its next tick
+    // Write to the counter prescale register and restart tick timing from now
+    counter = readCounter();
     countScale = (countScale & ~mask) | (value & mask);
-    countCycles = Core::schedule(tickCounter, countScale + 1);
+    countCycles = Core::globalCycles;
 }
 
 void Timers::writeCounter(uint32_t mask, uint32_t value) {
+    // Bring the counter up to date, keeping the tick phase
+    uint64_t ticks = (Core::globalCycles - countCycles) / (countScale + 1);
+    countCycles += ticks * (countScale + 1);
+    counter += ticks;
+
     // Write a new value to the counter
     counter = (counter & ~mask) | (value & mask);
 }
 
 void Timers::writeControl(int i, uint32_t mask, uint32_t value) {
     // Write to one of the timer control registers and reset the timer if disabled
+    updateTimers();
     controls[i] = (controls[i] & ~mask) | (value & mask);
     if (~controls[i] & 0x2) timers[i] = 0;
 
     // Set the prescale shift and adjust the timer if it changed
     uint8_t shift = (controls[i] & 0x1) ? (((controls[i] >> 4) & 0x7) + 1) : 0;
-    if (shifts[i] == shift) return;
-    timers[i] = (timers[i] >> shifts[i]) << shift;
-    shifts[i] = shift;
+    if (shifts[i] != shift) {
+        timers[i] = (timers[i] >> shifts[i]) << shift;
+        shifts[i] = shift;
+    }
+    scheduleMatch();
 }
 
 void Timers::writeTimer(int i, uint32_t mask, uint32_t value) {
     // Write one of the current timer values, adjusted for prescaling
+    updateTimers();
     timers[i] = (((timers[i] >> shifts[i]) & ~mask) | (value & mask)) << shifts[i];
+    scheduleMatch();
 }
 
 void Timers::writeTarget(int i, uint32_t mask, uint32_t value) {
     // Write to one of the timer target registers
+    updateTimers();
     targets[i] = (targets[i] & ~mask) | (value & mask);
+    scheduleMatch();
 }
@@ -21,11 +21,11 @@
 
 #include <cstdint>
 
-namespace Timers {
-    extern uint32_t timerCycles;
-    extern uint32_t countCycles;
+struct State;
 
+namespace Timers {
     void reset();
+    void syncState(State &state);
 
     uint32_t readCounter();
     uint32_t readControl(int i);
@@ -22,6 +22,8 @@
 #include <cstring>
 
 #include "wifi.h"
+#include "memory.h"
+#include "state.h"
 
 namespace Wifi {
     uint32_t response[4];
@@ -80,6 +82,34 @@ void Wifi::reset() {
     bufferAddr = 0;
     bufferSize = 0;
     bufferFunc = 0;
+
+    // Register the SDIO I/O registers
+    for (int i = 0; i < 4; i++)
+        Memory::registerRead(0xE0010010 + i * 4, 4, readResponse, i);
+    Memory::registerRead(0xE0010020, 4, IO_READ(readBufferData), 0, false);
+    Memory::registerRead(0xE001002C, 2, IO_READ(readClockCtrl));
+    Memory::registerRead(0xE0010030, 2, IO_READ(readIrqFlags));
+    Memory::registerRead(0xE0010034, 4, IO_READ(readIrqEnable));
+    Memory::registerRead(0xE0010040, 4, [](int) -> uint32_t { return 0x69EF30B0; }); // WiFi capabilities
+    Memory::registerWrite(0xE0010008, 4, IO_WRITE(writeArgs));
+    Memory::registerWrite(0xE001000E, 2, IO_WRITE(writeCommand));
+    Memory::registerWrite(0xE001002C, 2, IO_WRITE(writeClockCtrl));
+    Memory::registerWrite(0xE0010030, 2, IO_WRITE(writeIrqFlags));
+    Memory::registerWrite(0xE0010034, 2, IO_WRITE(writeIrqEnable));
+}
+
+void Wifi::syncState(State &state) {
+    // Save or load the registers and SDIO state
+    state.sync(response);
+    state.sync(args);
+    state.sync(irqFlags);
+    state.sync(irqEnable);
+    state.sync(clockControl);
+    state.sync(f1Address);
+    state.sync(clockCsr);
+    state.sync(bufferAddr);
+    state.sync(bufferSize);
+    state.sync(bufferFunc);
 }
 
 void Wifi::requestIrq(int i) {
@@ -21,8 +21,11 @@
 
 #include <cstdint>
 
+struct State;
+
 namespace Wifi {
     void reset();
+    void syncState(State &state);
 
     uint32_t readResponse(int i);
     uint32_t readBufferData();